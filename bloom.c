@@ -0,0 +1,109 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define BLOOM_DEFAULT_NAME "/libwritededuper-bloom"
+#define BLOOM_HASHES 4
+
+uint64_t *bloom = NULL;
+uint64_t bloom_mask;
+
+// Map the host-wide filter of indexed fingerprints, creating it on first use.
+// Its size in bytes is rounded down to a power of two, and a filter that
+// already exists keeps its own size.
+void bloom_init(void) {
+    char *str_size;
+    if (!(str_size = getenv("LIBWRITEDEDUPER_BLOOM_SIZE")))
+        return;
+
+    char *name;
+    if (!(name = getenv("LIBWRITEDEDUPER_BLOOM_NAME")))
+        name = BLOOM_DEFAULT_NAME;
+
+    int fd;
+    if ((fd = shm_open(name, O_RDWR | O_CREAT, 0600)) < 0) {
+        fprintf(stderr, "libwritededuper: couldn't open bloom filter: %m\n");
+        return;
+    }
+
+    // processes starting together would otherwise size it differently
+    struct stat st;
+    size_t size = sizeof(uint64_t);
+    if (flock(fd, LOCK_EX) < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "libwritededuper: couldn't size bloom filter: %m\n");
+        close(fd);
+        return;
+    }
+    if (st.st_size == 0) {
+        unsigned long requested = strtoul(str_size, NULL, 10);
+        while (size * 2 <= requested)
+            size *= 2;
+        if (ftruncate(fd, size) < 0) {
+            fprintf(stderr,
+                    "libwritededuper: couldn't size bloom filter: %m\n");
+            close(fd);
+            return;
+        }
+    } else
+        while (size * 2 <= (size_t)st.st_size)
+            size *= 2;
+    flock(fd, LOCK_UN);
+
+    uint64_t *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "libwritededuper: couldn't map bloom filter: %m\n");
+        return;
+    }
+
+    bloom = map;
+    bloom_mask = size * 8 - 1;
+}
+
+uint64_t bloom_mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111eb;
+    x ^= x >> 31;
+    return x;
+}
+
+uint64_t bloom_hash(const char *kind, dev_t dev, unsigned int key) {
+    uint64_t hash = bloom_mix(dev) ^ key;
+    while (*kind)
+        hash = bloom_mix(hash ^ ((uint64_t)(unsigned char)*kind++ << 32));
+    return bloom_mix(hash);
+}
+
+void bloom_add(const char *kind, dev_t dev, unsigned int key) {
+    if (!bloom)
+        return;
+
+    uint64_t hash = bloom_hash(kind, dev, key);
+    uint64_t step = bloom_mix(hash) | 1;
+    for (int i = 0; i < BLOOM_HASHES; i++, hash += step)
+        __atomic_fetch_or(&bloom[(hash & bloom_mask) / 64],
+                          1ULL << (hash % 64), __ATOMIC_RELAXED);
+}
+
+// Whether `key` may have been indexed. Always true without a filter.
+int bloom_contains(const char *kind, dev_t dev, unsigned int key) {
+    if (!bloom)
+        return 1;
+
+    uint64_t hash = bloom_hash(kind, dev, key);
+    uint64_t step = bloom_mix(hash) | 1;
+    for (int i = 0; i < BLOOM_HASHES; i++, hash += step)
+        if (!(__atomic_load_n(&bloom[(hash & bloom_mask) / 64],
+                              __ATOMIC_RELAXED) &
+              (1ULL << (hash % 64))))
+            return 0;
+    return 1;
+}
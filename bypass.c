@@ -0,0 +1,108 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashmap/hashmap.h"
+
+#define BYPASS_SKIP 0
+#define BYPASS_DEDUP 1
+#define BYPASS_PROBE 2
+
+// Files with the same extension tend to hold the same kind of data, so a
+// file whose extension keeps missing is passed through from its first write.
+struct BypassExtension {
+    char extension[16];
+    size_t misses;
+};
+
+// Blocks in a row that must miss before writes are passed through, 0 never
+size_t bypass_misses = 256;
+// One in this many passed through writes still probes the index
+size_t bypass_probe = 64;
+struct hashmap *bypass_extensions;
+pthread_mutex_t bypass_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t bypass_extension_hash(const void *item, uint64_t seed0,
+                               uint64_t seed1) {
+    const struct BypassExtension *extension = item;
+    return hashmap_sip(extension->extension, strlen(extension->extension),
+                       seed0, seed1);
+}
+
+int bypass_extension_compare(const void *a, const void *b, void *data) {
+    const struct BypassExtension *aa = a;
+    const struct BypassExtension *bb = b;
+    return strcmp(aa->extension, bb->extension);
+}
+
+void bypass_init(void) {
+    char *str_misses;
+    if ((str_misses = getenv("LIBWRITEDEDUPER_BYPASS_MISSES")))
+        bypass_misses = strtoul(str_misses, NULL, 10);
+    char *str_probe;
+    if ((str_probe = getenv("LIBWRITEDEDUPER_BYPASS_PROBE")) &&
+        !(bypass_probe = strtoul(str_probe, NULL, 10)))
+        bypass_probe = 1;
+
+    bypass_extensions = hashmap_new(sizeof(struct BypassExtension), 0, 0, 0,
+                                    bypass_extension_hash,
+                                    bypass_extension_compare, NULL, NULL);
+}
+
+// Fill in the extension of the file name at the end of `path`, returning 0
+// if it has none worth tracking.
+int bypass_extension(const char *path, struct BypassExtension *extension) {
+    const char *name = strrchr(path, '/');
+    const char *dot = strrchr(name ? name : path, '.');
+    if (!dot || dot[1] == 0 || strlen(dot) >= sizeof(extension->extension))
+        return 0;
+
+    strcpy(extension->extension, dot);
+    return 1;
+}
+
+// Whether the write to `fd`, open on `path`, goes through the index. Returns
+// BYPASS_PROBE for the occasional write of a stream that missed too often,
+// which only has its first extent looked up.
+int bypass_check(int fd, const char *path) {
+    struct Stream stream;
+    if (!bypass_misses || !get_stream(fd, &stream))
+        return BYPASS_DEDUP;
+
+    int bypassed = stream.misses >= bypass_misses;
+    struct BypassExtension key = {0};
+    if (!bypassed && bypass_extension(path, &key)) {
+        pthread_mutex_lock(&bypass_lock);
+        const struct BypassExtension *extension =
+            hashmap_get(bypass_extensions, &key);
+        bypassed = extension && extension->misses >= bypass_misses;
+        pthread_mutex_unlock(&bypass_lock);
+    }
+    if (!bypassed)
+        return BYPASS_DEDUP;
+
+    return stream_count_bypassed(fd) % bypass_probe == 0 ? BYPASS_PROBE
+                                                         : BYPASS_SKIP;
+}
+
+// Account for a write of `blocks` blocks to `fd` of which `hits` were cloned.
+// A single hit puts the stream and its extension back into full use.
+void bypass_update(int fd, const char *path, size_t blocks, size_t hits) {
+    struct Stream stream;
+    if (!bypass_misses || !blocks || !get_stream(fd, &stream))
+        return;
+
+    stream_count_misses(fd, blocks, hits);
+
+    struct BypassExtension extension = {0};
+    if (!bypass_extension(path, &extension))
+        return;
+    pthread_mutex_lock(&bypass_lock);
+    const struct BypassExtension *old = hashmap_get(bypass_extensions,
+                                                    &extension);
+    extension.misses = hits ? 0 : (old ? old->misses : 0) + blocks;
+    hashmap_set(bypass_extensions, &extension);
+    pthread_mutex_unlock(&bypass_lock);
+}
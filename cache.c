@@ -0,0 +1,398 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CACHE_MAGIC "LWDCACHE"
+#define CACHE_VERSION 2
+
+// A location this process recently recorded or cloned from, in the slot
+// picked by the hash of its key, evicting whatever was there.
+struct CacheSlot {
+    uint64_t hash;
+    char *path;
+    off_t offset;
+    // when it was last recorded or cloned from
+    time_t used;
+    // not saved since
+    int dirty;
+};
+
+struct CacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+};
+
+// Records follow the header sorted by `hash`, then the NUL terminated paths
+// they point into by offset.
+struct CacheRecord {
+    uint64_t hash;
+    int64_t offset;
+    int64_t used;
+    uint64_t path;
+};
+
+struct CacheMerge {
+    uint64_t hash;
+    int64_t offset;
+    int64_t used;
+    const char *path;
+    int saved;
+};
+
+// The slots filled since the last save, copied out so that the snapshot can
+// be merged and written without holding up lookups
+struct CacheSave {
+    struct CacheMerge *merged;
+    size_t count;
+    time_t now;
+};
+
+struct CacheSlot *cache_slots = NULL;
+size_t cache_mask;
+// slots filled since the snapshot was last saved
+size_t cache_dirty = 0;
+int cache_saving = 0;
+
+char *cache_snapshot_path = NULL;
+long cache_interval = 60;
+time_t cache_saved_at = 0;
+const struct CacheHeader *cache_snapshot = NULL;
+size_t cache_snapshot_size;
+
+// Whether the snapshot mapped at `header` is whole: its records sorted and
+// unique, and their paths inside the NUL terminated strings after them.
+int cache_valid(const struct CacheHeader *header, size_t size) {
+    if (memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != CACHE_VERSION ||
+        header->count > (size - sizeof(*header)) / sizeof(struct CacheRecord))
+        return 0;
+
+    const struct CacheRecord *records = (const struct CacheRecord *)&header[1];
+    size_t strings = size - sizeof(*header) -
+                     (size_t)header->count * sizeof(struct CacheRecord);
+    if (header->count &&
+        (!strings || ((const char *)header)[size - 1] != 0))
+        return 0;
+    for (size_t i = 0; i < header->count; i++)
+        if (records[i].path >= strings ||
+            (i && records[i - 1].hash >= records[i].hash))
+            return 0;
+    return 1;
+}
+
+// Map the newest snapshot, or return NULL if it is missing or isn't whole.
+const struct CacheHeader *cache_open(size_t *size, time_t *mtime) {
+    int fd;
+    if ((fd = open(cache_snapshot_path, O_RDONLY | O_CLOEXEC)) < 0)
+        return NULL;
+
+    struct stat st;
+    const struct CacheHeader *header = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(*header))
+        header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED)
+        return NULL;
+
+    if (!cache_valid(header, st.st_size)) {
+        fprintf(stderr, "libwritededuper: ignoring invalid snapshot %s\n",
+                cache_snapshot_path);
+        munmap((void *)header, st.st_size);
+        return NULL;
+    }
+
+    *size = st.st_size;
+    *mtime = st.st_mtime;
+    return header;
+}
+
+// Map the snapshot lookups go to, replacing the one mapped before.
+void cache_map(void) {
+    if (cache_snapshot)
+        munmap((void *)cache_snapshot, cache_snapshot_size);
+    cache_snapshot = cache_open(&cache_snapshot_size, &cache_saved_at);
+}
+
+void cache_init(void) {
+    size_t size = 65536;
+    char *str_size;
+    if ((str_size = getenv("LIBWRITEDEDUPER_CACHE_SIZE")))
+        size = strtoul(str_size, NULL, 10);
+    if (!size)
+        return;
+
+    size_t slots = 1;
+    while (slots * 2 <= size)
+        slots *= 2;
+    if (!(cache_slots = calloc(slots, sizeof(struct CacheSlot))))
+        return;
+    cache_mask = slots - 1;
+
+    char *str_interval;
+    if ((str_interval = getenv("LIBWRITEDEDUPER_SNAPSHOT_INTERVAL")))
+        cache_interval = atol(str_interval);
+    if ((cache_snapshot_path = getenv("LIBWRITEDEDUPER_SNAPSHOT")) &&
+        *cache_snapshot_path)
+        cache_map();
+    else
+        cache_snapshot_path = NULL;
+}
+
+const struct CacheRecord *cache_records(const struct CacheHeader *snapshot) {
+    return (const struct CacheRecord *)&snapshot[1];
+}
+
+const char *cache_record_path(const struct CacheHeader *snapshot,
+                              const struct CacheRecord *record) {
+    return (const char *)&cache_records(snapshot)[snapshot->count] +
+           record->path;
+}
+
+const struct CacheRecord *cache_find(uint64_t hash) {
+    if (!cache_snapshot)
+        return NULL;
+
+    const struct CacheRecord *records = cache_records(cache_snapshot);
+    size_t low = 0, high = cache_snapshot->count;
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        if (records[middle].hash < hash)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low < cache_snapshot->count && records[low].hash == hash
+               ? &records[low]
+               : NULL;
+}
+
+// Look `hash` up in this process' slots, then in the snapshot. `path` is set
+// to a copy the caller frees.
+int cache_get(uint64_t hash, char **path, off_t *offset) {
+    if (!cache_slots)
+        return 0;
+
+    const char *found = NULL;
+    struct CacheSlot *slot = &cache_slots[hash & cache_mask];
+    const struct CacheRecord *record;
+    if (slot->path && slot->hash == hash) {
+        found = slot->path;
+        *offset = slot->offset;
+    } else if ((record = cache_find(hash))) {
+        found = cache_record_path(cache_snapshot, record);
+        *offset = record->offset;
+    }
+    return found && (*path = strdup(found));
+}
+
+void cache_put(uint64_t hash, const char *path, off_t offset) {
+    if (!cache_slots)
+        return;
+
+    time_t now = time(NULL);
+    struct CacheSlot *slot = &cache_slots[hash & cache_mask];
+    if (slot->path && slot->hash == hash && slot->offset == offset &&
+        strcmp(slot->path, path) == 0) {
+        if (slot->used != now && !slot->dirty) {
+            slot->dirty = 1;
+            cache_dirty++;
+        }
+        slot->used = now;
+        return;
+    }
+
+    char *copy;
+    if (!(copy = strdup(path)))
+        return;
+    if (!slot->dirty)
+        cache_dirty++;
+    free(slot->path);
+    *slot = (struct CacheSlot){
+        .hash = hash, .path = copy, .offset = offset, .used = now, .dirty = 1};
+}
+
+// By hash, then from the most recently used, this process' own first
+int cache_merge_compare(const void *a, const void *b) {
+    const struct CacheMerge *aa = a;
+    const struct CacheMerge *bb = b;
+    if (aa->hash != bb->hash)
+        return aa->hash < bb->hash ? -1 : 1;
+    if (aa->used != bb->used)
+        return aa->used > bb->used ? -1 : 1;
+    return aa->saved - bb->saved;
+}
+
+int cache_recency_compare(const void *a, const void *b) {
+    const struct CacheMerge *aa = a;
+    const struct CacheMerge *bb = b;
+    if (aa->used != bb->used)
+        return aa->used > bb->used ? -1 : 1;
+    return aa->saved - bb->saved;
+}
+
+// Write `merged` out as a snapshot at `path` with `writev`, so that nothing
+// goes through the intercepted `write` or a tracked mapping.
+int cache_write(const char *path, struct CacheMerge *merged, size_t count) {
+    size_t strings = 0;
+    for (size_t i = 0; i < count; i++)
+        strings += strlen(merged[i].path) + 1;
+    size_t size = sizeof(struct CacheHeader) +
+                  count * sizeof(struct CacheRecord) + strings;
+
+    unsigned char *data;
+    if (!(data = malloc(size)))
+        return 0;
+    *(struct CacheHeader *)data = (struct CacheHeader){
+        .magic = CACHE_MAGIC, .version = CACHE_VERSION, .count = count};
+    struct CacheRecord *records = (struct CacheRecord *)&data[sizeof(
+        struct CacheHeader)];
+    char *string = (char *)&records[count];
+    for (size_t i = 0, used = 0; i < count; i++) {
+        records[i] = (struct CacheRecord){.hash = merged[i].hash,
+                                          .offset = merged[i].offset,
+                                          .used = merged[i].used,
+                                          .path = used};
+        size_t length = strlen(merged[i].path) + 1;
+        memcpy(&string[used], merged[i].path, length);
+        used += length;
+    }
+
+    int fd;
+    size_t written = 0;
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) >=
+        0) {
+        ssize_t result;
+        struct iovec iov;
+        while (written < size) {
+            iov = (struct iovec){&data[written], size - written};
+            if ((result = writev(fd, &iov, 1)) <= 0)
+                break;
+            written += result;
+        }
+        close(fd);
+    }
+    free(data);
+    return written == size;
+}
+
+// Copy the slots filled since the last save, under the lock guarding them,
+// if a save is due. It is skipped unless `force`d while the snapshot is
+// younger than the interval, whoever saved it, so that short lived processes
+// don't keep rewriting it.
+struct CacheSave *cache_save_begin(int force) {
+    if (!cache_snapshot_path || !cache_dirty || cache_saving)
+        return NULL;
+
+    struct stat st;
+    time_t now = time(NULL);
+    if (!force && (now < cache_saved_at + cache_interval ||
+                   (stat(cache_snapshot_path, &st) == 0 &&
+                    now < (cache_saved_at = st.st_mtime) + cache_interval)))
+        return NULL;
+
+    struct CacheSave *save = calloc(1, sizeof(struct CacheSave));
+    if (!save || !(save->merged = malloc(cache_dirty *
+                                         sizeof(struct CacheMerge)))) {
+        free(save);
+        return NULL;
+    }
+    for (size_t i = 0; i <= cache_mask && save->count < cache_dirty; i++) {
+        struct CacheSlot *slot = &cache_slots[i];
+        const char *path;
+        if (!slot->dirty || !(path = strdup(slot->path)))
+            continue;
+        save->merged[save->count++] = (struct CacheMerge){
+            slot->hash, slot->offset, slot->used, path, 0};
+        slot->dirty = 0;
+    }
+    cache_dirty = 0;
+    cache_saving = 1;
+    save->now = now;
+    return save;
+}
+
+// Merge the copied slots into the newest snapshot, keeping at most as many
+// locations as there are slots, the most recently used first, and replace it.
+// This runs without the lock.
+int cache_save_write(struct CacheSave *save) {
+    size_t size = 0;
+    time_t mtime;
+    // the snapshot may have been replaced by another process since
+    const struct CacheHeader *snapshot = cache_open(&size, &mtime);
+    size_t saved = snapshot ? snapshot->count : 0;
+    size_t capacity = cache_mask + 1;
+    struct CacheMerge *merged =
+        malloc((save->count + saved) * sizeof(struct CacheMerge) + 1);
+    if (!merged) {
+        if (snapshot)
+            munmap((void *)snapshot, size);
+        return 0;
+    }
+
+    memcpy(merged, save->merged, save->count * sizeof(struct CacheMerge));
+    size_t count = save->count;
+    for (size_t i = 0; i < saved; i++) {
+        const struct CacheRecord *record = &cache_records(snapshot)[i];
+        merged[count++] = (struct CacheMerge){
+            record->hash, record->offset, record->used,
+            cache_record_path(snapshot, record), 1};
+    }
+
+    qsort(merged, count, sizeof(struct CacheMerge), cache_merge_compare);
+    size_t unique = 0;
+    for (size_t i = 0; i < count; i++)
+        if (!unique || merged[i].hash != merged[unique - 1].hash)
+            merged[unique++] = merged[i];
+    // the least recently used are evicted
+    if (unique > capacity) {
+        qsort(merged, unique, sizeof(struct CacheMerge),
+              cache_recency_compare);
+        unique = capacity;
+        qsort(merged, unique, sizeof(struct CacheMerge), cache_merge_compare);
+    }
+
+    char temporary[PATH_MAX];
+    snprintf(temporary, sizeof(temporary), "%s.%d", cache_snapshot_path,
+             getpid());
+    int ok = cache_write(temporary, merged, unique) &&
+             rename(temporary, cache_snapshot_path) == 0;
+    if (!ok) {
+        fprintf(stderr, "libwritededuper: couldn't save snapshot %s: %m\n",
+                cache_snapshot_path);
+        unlink(temporary);
+    }
+    free(merged);
+    if (snapshot)
+        munmap((void *)snapshot, size);
+    return ok;
+}
+
+// Map the saved snapshot for lookups, back under the lock. Slots that
+// couldn't be saved are left for the next save, unless they were replaced.
+void cache_save_end(struct CacheSave *save, int saved) {
+    for (size_t i = 0; i < save->count; i++) {
+        struct CacheMerge *merge = &save->merged[i];
+        struct CacheSlot *slot = &cache_slots[merge->hash & cache_mask];
+        if (!saved && !slot->dirty && slot->path &&
+            slot->hash == merge->hash) {
+            slot->dirty = 1;
+            cache_dirty++;
+        }
+        free((char *)merge->path);
+    }
+    if (saved)
+        cache_map();
+    cache_saved_at = save->now;
+    cache_saving = 0;
+    free(save->merged);
+    free(save);
+}
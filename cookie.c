@@ -0,0 +1,88 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "hashmap/hashmap.h"
+
+// An output stdio stream wrapped with `fopencookie`, whose writes are gathered
+// into whole blocks at block aligned offsets before going through
+// `handle_write`.
+struct Cookie {
+    FILE *file;
+    int fd;
+    // where `data` goes in the file
+    off_t offset;
+    unsigned char *data;
+    size_t length;
+    // write everything out right away, for unbuffered and line buffered
+    // streams
+    int sync;
+    pthread_mutex_t lock;
+};
+
+struct CookieFile {
+    FILE *file;
+    struct Cookie *cookie;
+};
+
+// Size of the buffer in bytes, a multiple of BLOCK_SIZE, 0 to not wrap streams
+size_t cookie_buffer_size = 256 * 1024;
+// Set once buffers are written out at exit, after which nothing is held back
+int cookie_exiting = 0;
+struct hashmap *cookie_files;
+pthread_mutex_t cookie_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t cookie_file_hash(const void *item, uint64_t seed0, uint64_t seed1) {
+    const struct CookieFile *file = item;
+    return hashmap_sip(&file->file, sizeof(file->file), seed0, seed1);
+}
+
+int cookie_file_compare(const void *a, const void *b, void *data) {
+    const struct CookieFile *aa = a;
+    const struct CookieFile *bb = b;
+    return aa->file != bb->file;
+}
+
+void cookie_init(void) {
+    char *str_buffer_size;
+    if ((str_buffer_size = getenv("LIBWRITEDEDUPER_STDIO_BUFFER")))
+        cookie_buffer_size = strtoul(str_buffer_size, NULL, 10);
+    cookie_buffer_size -= cookie_buffer_size % BLOCK_SIZE;
+
+    cookie_files = hashmap_new(sizeof(struct CookieFile), 0, 0, 0,
+                               cookie_file_hash, cookie_file_compare, NULL,
+                               NULL);
+}
+
+int cookie_wrapped(FILE *file) {
+    pthread_mutex_lock(&cookie_lock);
+    int wrapped =
+        hashmap_get(cookie_files, &(struct CookieFile){.file = file}) != NULL;
+    pthread_mutex_unlock(&cookie_lock);
+    return wrapped;
+}
+
+// How much more fits in the buffer, which ends on a block boundary even if
+// the stream was seeked to the middle of a block.
+size_t cookie_space(const struct Cookie *cookie) {
+    return cookie_buffer_size - cookie->offset % BLOCK_SIZE - cookie->length;
+}
+
+// The `open` flags of an `fopen` mode that only writes a file from its start,
+// or -1 for any other mode, as reads and appends would have to see through the
+// buffer.
+int cookie_flags(const char *mode) {
+    if (*mode != 'w' || strpbrk(mode, "+,"))
+        return -1;
+
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    if (strchr(mode, 'e'))
+        flags |= O_CLOEXEC;
+    if (strchr(mode, 'x'))
+        flags |= O_EXCL;
+    return flags;
+}
@@ -0,0 +1,173 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "crc32.c"
+#include "fd.c"
+#include "hashmap/hashmap.c"
+#include "hashtable.c"
+#include "hiredis/hiredis.h"
+#include "stream.c"
+#include "uring.c"
+
+static ssize_t (*libc_pwrite)(int fd, const void *buf, size_t count,
+                              off_t offset) = pwrite;
+static ssize_t (*libc_pread)(int fd, void *buf, size_t count,
+                             off_t offset) = pread;
+static ssize_t (*libc_copy_file_range)(int in_fd, off_t *in_offset,
+                                       int out_fd, off_t *out_offset,
+                                       size_t length,
+                                       unsigned int flags) = copy_file_range;
+
+#include "dedup.c"
+#include "ring.c"
+
+void handle_slot(struct RingSlot *slot) {
+    char path[PATH_MAX] = {0};
+    char fd_link[PATH_MAX] = {0};
+    sprintf(fd_link, "/proc/%d/fd/%d", slot->pid, slot->fd);
+
+    struct Source sources[RING_BLOCKS] = {0};
+    struct Entry entries[RING_BLOCKS + RING_BLOCKS / EXTENT_BLOCKS];
+    struct Dedup dedup = {
+        .fd = -1,
+        .path = path,
+        .offset = slot->offset,
+        .buf = slot->data,
+        .blocks = slot->blocks,
+        .hashes = slot->hashes,
+        .sources = sources,
+    };
+
+    char in_path[PATH_MAX];
+    strlcpy(in_path, slot->in_path, PATH_MAX - 1);
+    memset(slot->cloned, 0, sizeof(slot->cloned));
+    slot->in_path[0] = 0;
+
+    // reopened like the process did, as the filesystem is identified through
+    // a descriptor
+    struct stat st;
+    if (readlink(fd_link, path, PATH_MAX - 1) < 0 ||
+        dedup.blocks > RING_BLOCKS ||
+        (dedup.fd = open(fd_link, slot->type == RING_READ ? O_RDONLY
+                                                          : O_WRONLY)) < 0)
+        return;
+    if (fstat(dedup.fd, &st) < 0) {
+        close(dedup.fd);
+        return;
+    }
+    dedup.dev = dedup_filesystem(dedup.fd, st.st_dev);
+    if (slot->type == RING_READ) {
+        dedup_record(&dedup, entries);
+        close(dedup.fd);
+        return;
+    }
+
+    if (in_path[0])
+        dedup_predict(&dedup, in_path, slot->in_offset);
+    size_t entry_count = dedup_lookup(&dedup, entries);
+    dedup_clone(&dedup);
+
+    for (size_t i = 0; i < dedup.blocks; i++)
+        slot->cloned[i] = sources[i].path != NULL;
+    if (dedup.blocks && sources[dedup.blocks - 1].path) {
+        strlcpy(slot->in_path, sources[dedup.blocks - 1].path, PATH_MAX - 1);
+        slot->in_offset = sources[dedup.blocks - 1].offset + BLOCK_SIZE;
+    }
+
+    hashtable_free_batch(entries, entry_count);
+    dedup_record(&dedup, entries);
+    close(dedup.fd);
+}
+
+// Free the slots of processes that died before collecting their results.
+void reclaim_slots(struct Ring *ring) {
+    for (int i = 0; i < RING_SLOTS; i++) {
+        struct RingSlot *slot = &ring->slots[i];
+        uint32_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+        if ((state == RING_SLOT_CLAIMED || state == RING_SLOT_DONE) &&
+            kill(slot->pid, 0) != 0 && errno == ESRCH)
+            __atomic_compare_exchange_n(&slot->state, &state, RING_SLOT_FREE,
+                                        0, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED);
+    }
+}
+
+volatile sig_atomic_t stopping = 0;
+
+void handle_signal(int sig) { stopping = 1; }
+
+int main(int argc, char **argv) {
+    hashtable_init();
+    uring_init();
+
+    working_fds = hashmap_new(sizeof(struct WorkingFd), 0, 0, 0,
+                              working_fd_hash, working_fd_compare, NULL, NULL);
+
+    int fd;
+    shm_unlink(ring_name());
+    if ((fd = shm_open(ring_name(), O_RDWR | O_CREAT | O_EXCL, 0600)) < 0 ||
+        ftruncate(fd, sizeof(struct Ring)) < 0) {
+        fprintf(stderr, "libwritededuperd: couldn't create %s: %m\n",
+                ring_name());
+        return EXIT_FAILURE;
+    }
+
+    struct Ring *ring;
+    if ((ring = mmap(NULL, sizeof(struct Ring), PROT_READ | PROT_WRITE,
+                     MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        fprintf(stderr, "libwritededuperd: couldn't map %s: %m\n",
+                ring_name());
+        return EXIT_FAILURE;
+    }
+    close(fd);
+
+    // without SA_RESTART, so that a signal interrupts the wait on the doorbell
+    struct sigaction action = {.sa_handler = handle_signal};
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    ring->pid = getpid();
+    __atomic_store_n(&ring->magic, RING_MAGIC, __ATOMIC_RELEASE);
+
+    struct timespec timeout = {1, 0};
+    while (!stopping) {
+        uint32_t doorbell =
+            __atomic_load_n(&ring->doorbell, __ATOMIC_ACQUIRE);
+
+        for (int i = 0; i < RING_SLOTS; i++) {
+            struct RingSlot *slot = &ring->slots[i];
+            uint32_t expected = RING_SLOT_SUBMITTED;
+            if (!__atomic_compare_exchange_n(&slot->state, &expected,
+                                             RING_SLOT_PROCESSING, 0,
+                                             __ATOMIC_ACQUIRE,
+                                             __ATOMIC_RELAXED))
+                continue;
+
+            handle_slot(slot);
+            __atomic_store_n(&slot->state,
+                             slot->type == RING_READ ? RING_SLOT_FREE
+                                                     : RING_SLOT_DONE,
+                             __ATOMIC_RELEASE);
+            ring_futex(&slot->state, FUTEX_WAKE, INT_MAX, NULL);
+        }
+
+        if (ring_futex(&ring->doorbell, FUTEX_WAIT, doorbell, &timeout) < 0 &&
+            errno == ETIMEDOUT)
+            reclaim_slots(ring);
+    }
+
+    hashtable_save(1);
+    shm_unlink(ring_name());
+    return EXIT_SUCCESS;
+}
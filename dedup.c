@@ -0,0 +1,558 @@
+#include <errno.h>
+#include <linux/fs.h>
+#include <linux/limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+#include "hashmap/hashmap.h"
+
+// <linux/fs.h> defines its own, the size of the legacy 1 KiB blocks
+#undef BLOCK_SIZE
+#define BLOCK_SIZE 4096
+#define EXTENT_BLOCKS 16
+#define EXTENT_SIZE (EXTENT_BLOCKS * BLOCK_SIZE)
+
+// Only in the headers of kernels from 6.5 on
+#ifndef FS_IOC_GETFSUUID
+struct fsuuid2 {
+    uint8_t len;
+    uint8_t uuid[16];
+};
+#define FS_IOC_GETFSUUID _IOR(0x15, 0, struct fsuuid2)
+#endif
+
+// Run `ops` as one batch, through io_uring when it's available and one
+// syscall at a time otherwise, stopping at the first failed write.
+void io_batch(struct IoOp *ops, size_t count, int write) {
+    if (uring_batch(ops, count, write))
+        return;
+
+    for (size_t i = 0; i < count; i++) {
+        ssize_t result =
+            write ? (*libc_pwrite)(ops[i].fd, ops[i].buf, ops[i].length,
+                                   ops[i].offset)
+                  : (*libc_pread)(ops[i].fd, ops[i].buf, ops[i].length,
+                                  ops[i].offset);
+        ops[i].result = result < 0 ? -errno : result;
+        if (write && ops[i].result < (ssize_t)ops[i].length) {
+            while (++i < count)
+                ops[i].result = 0;
+            return;
+        }
+    }
+}
+
+// Check that `in_path` holds the same `length` bytes as `data` at `in_offset`.
+int verify_range(const unsigned char *data, size_t length, char *in_path,
+                 off_t in_offset) {
+    int in_fd;
+    if ((in_fd = get_working_fd(in_path)) < 0)
+        return 0;
+
+    unsigned char in_buf[BLOCK_SIZE];
+    int same = 1;
+    for (size_t block_offset = 0; same && block_offset < length;
+         block_offset += BLOCK_SIZE)
+        same = (*libc_pread)(in_fd, in_buf, BLOCK_SIZE,
+                             in_offset + block_offset) == BLOCK_SIZE &&
+               memcmp(&data[block_offset], in_buf, BLOCK_SIZE) == 0;
+    put_working_fd(in_path);
+    return same;
+}
+
+uint32_t calculate_extent_hash(const uint32_t *hashes) {
+    return calculate_crc32c(0, (const unsigned char *)hashes,
+                            EXTENT_BLOCKS * sizeof(uint32_t));
+}
+
+struct DedupFilesystem {
+    dev_t dev;
+    dev_t id;
+};
+
+struct hashmap *dedup_filesystems;
+pthread_mutex_t dedup_filesystem_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t dedup_filesystem_hash(const void *item, uint64_t seed0,
+                               uint64_t seed1) {
+    const struct DedupFilesystem *filesystem = item;
+    return hashmap_sip(&filesystem->dev, sizeof(filesystem->dev), seed0,
+                       seed1);
+}
+
+int dedup_filesystem_compare(const void *a, const void *b, void *data) {
+    const struct DedupFilesystem *aa = a;
+    const struct DedupFilesystem *bb = b;
+    return aa->dev != bb->dev;
+}
+
+// Identify the filesystem `fd` is on, which is on device `dev`, by something
+// that survives reboots and remounts unlike the device number: its UUID, or
+// else the id `statfs` reports. The device number is only used when neither
+// is available. Checked once per device.
+dev_t dedup_filesystem(int fd, dev_t dev) {
+    dev_t id = dev;
+    pthread_mutex_lock(&dedup_filesystem_lock);
+    if (!dedup_filesystems)
+        dedup_filesystems = hashmap_new(
+            sizeof(struct DedupFilesystem), 0, 0, 0, dedup_filesystem_hash,
+            dedup_filesystem_compare, NULL, NULL);
+    const struct DedupFilesystem *filesystem = NULL;
+    if (dedup_filesystems)
+        filesystem = hashmap_get(dedup_filesystems,
+                                 &(struct DedupFilesystem){.dev = dev});
+    if (filesystem)
+        id = filesystem->id;
+    pthread_mutex_unlock(&dedup_filesystem_lock);
+    if (filesystem)
+        return id;
+
+    struct fsuuid2 uuid = {.len = sizeof(uuid.uuid)};
+    static const uint8_t nil[sizeof(uuid.uuid)];
+    struct statfs fs;
+    if (ioctl(fd, FS_IOC_GETFSUUID, &uuid) == 0 && uuid.len &&
+        uuid.len <= sizeof(uuid.uuid) && memcmp(uuid.uuid, nil, uuid.len) != 0)
+        id = hashmap_sip(uuid.uuid, uuid.len, 0, 0);
+    else if (fstatfs(fd, &fs) == 0 &&
+             (fs.f_fsid.__val[0] || fs.f_fsid.__val[1]))
+        id = (dev_t)(unsigned int)fs.f_fsid.__val[0] << 32 |
+             (unsigned int)fs.f_fsid.__val[1];
+    else
+        return dev;
+
+    pthread_mutex_lock(&dedup_filesystem_lock);
+    if (dedup_filesystems)
+        hashmap_set(dedup_filesystems,
+                    &(struct DedupFilesystem){.dev = dev, .id = id});
+    pthread_mutex_unlock(&dedup_filesystem_lock);
+    return id;
+}
+
+#define DEDUP_INDEXED_BLOCK 1
+#define DEDUP_INDEXED_EXTENT 2
+
+struct Source {
+    char *path;
+    off_t offset;
+    int extent;
+    // which index entries already point at this block of the target
+    int indexed;
+};
+
+// Where a write is going, and where each of its blocks can be cloned from.
+// Blocks without a source `path` have to be written out.
+struct Dedup {
+    int fd;
+    // filesystem, from `dedup_filesystem`
+    dev_t dev;
+    char *path;
+    off_t offset;
+    const unsigned char *buf;
+    size_t blocks;
+    uint32_t *hashes;
+    struct Source *sources;
+    // the blocks are already stored and may change while they are looked up,
+    // so only ranges the kernel itself finds identical are shared
+    int share;
+};
+
+// The part of `dedup` from block `first` on.
+struct Dedup dedup_rest(const struct Dedup *dedup, size_t first) {
+    struct Dedup rest = *dedup;
+    rest.offset += first * BLOCK_SIZE;
+    rest.buf = &dedup->buf[first * BLOCK_SIZE];
+    rest.blocks -= first;
+    rest.hashes = &dedup->hashes[first];
+    if (dedup->sources)
+        rest.sources = &dedup->sources[first];
+    return rest;
+}
+
+int dedup_extent_aligned(struct Dedup *dedup, size_t i) {
+    return (dedup->offset + i * BLOCK_SIZE) % EXTENT_SIZE == 0 &&
+           i + EXTENT_BLOCKS <= dedup->blocks;
+}
+
+void dedup_set_sources(struct Dedup *dedup, size_t i, size_t blocks,
+                       char *in_path, off_t in_offset, int extent) {
+    for (size_t j = i; j < i + blocks; j++) {
+        dedup->sources[j].path = in_path;
+        dedup->sources[j].offset = in_offset + (j - i) * BLOCK_SIZE;
+        dedup->sources[j].extent = in_path && extent;
+    }
+}
+
+int dedup_resolve(struct Dedup *dedup, size_t i, size_t blocks, char *in_path,
+                  off_t in_offset, int extent) {
+    if (!verify_range(&dedup->buf[i * BLOCK_SIZE], blocks * BLOCK_SIZE,
+                      in_path, in_offset))
+        return 0;
+
+    dedup_set_sources(dedup, i, blocks, in_path, in_offset, extent);
+    return 1;
+}
+
+// Verify the candidate sources of `entries`, each covering `blocks` blocks,
+// with the reads of all entries' best candidates submitted as one batch, then
+// those of the next best for the entries still unresolved, and so on. Only
+// the reads of a round are buffered at once.
+void dedup_resolve_batch(struct Dedup *dedup, struct Entry *entries,
+                         size_t count, size_t blocks, int extent) {
+    size_t length = blocks * BLOCK_SIZE;
+    struct IoOp *ops = malloc(count * sizeof(struct IoOp));
+    size_t *op_entries = malloc(count * sizeof(size_t));
+    unsigned char *in_buf = NULL;
+    if (!ops || !op_entries) {
+        fprintf(stderr, "libwritededuper: couldn't allocate the verification "
+                        "of %zu candidates\n",
+                count);
+        free(ops);
+        free(op_entries);
+        return;
+    }
+
+    for (size_t candidate = 0, left = 1; left; candidate++) {
+        size_t op_count = 0;
+        left = 0;
+        for (size_t i = 0; i < count; i++) {
+            int in_fd;
+            if (entries[i].used || !hashtable_candidate(&entries[i], candidate))
+                continue;
+            left = 1;
+            if ((in_fd = get_working_fd(entries[i].path)) < 0)
+                continue;
+
+            op_entries[op_count] = i;
+            ops[op_count++] = (struct IoOp){
+                .fd = in_fd,
+                .length = length,
+                .offset = entries[i].offset,
+            };
+        }
+        if (!op_count)
+            continue;
+
+        free(in_buf);
+        if (!(in_buf = malloc(op_count * length))) {
+            fprintf(stderr,
+                    "libwritededuper: couldn't allocate %zu bytes to verify "
+                    "candidates\n",
+                    op_count * length);
+            for (size_t i = 0; i < op_count; i++)
+                put_working_fd(entries[op_entries[i]].path);
+            break;
+        }
+        for (size_t i = 0; i < op_count; i++)
+            ops[i].buf = &in_buf[i * length];
+        io_batch(ops, op_count, 0);
+        for (size_t i = 0; i < op_count; i++)
+            put_working_fd(entries[op_entries[i]].path);
+
+        for (size_t i = 0; i < op_count; i++) {
+            struct Entry *entry = &entries[op_entries[i]];
+            if (ops[i].result < (ssize_t)length ||
+                memcmp(&dedup->buf[entry->index * BLOCK_SIZE], ops[i].buf,
+                       length) != 0)
+                continue;
+
+            entry->used = 1;
+            dedup_set_sources(dedup, entry->index, blocks, entry->path,
+                              entry->offset, extent);
+        }
+    }
+
+    free(ops);
+    free(op_entries);
+    free(in_buf);
+}
+
+// Look the entries whose cached location failed verification up in the
+// index after all, and verify its candidates, so that a stale local cache or
+// snapshot only costs the lookups it would have saved.
+void dedup_resolve_stale(struct Dedup *dedup, struct Entry *entries,
+                         size_t count, size_t blocks, int extent) {
+    size_t stale_count = 0;
+    for (size_t i = 0; i < count; i++)
+        stale_count += entries[i].cached && !entries[i].used;
+    if (!stale_count)
+        return;
+
+    struct Entry *stale = malloc(stale_count * sizeof(struct Entry));
+    size_t *positions = malloc(stale_count * sizeof(size_t));
+    if (!stale || !positions) {
+        free(stale);
+        free(positions);
+        return;
+    }
+
+    stale_count = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (!entries[i].cached || entries[i].used)
+            continue;
+        positions[stale_count] = i;
+        stale[stale_count++] = (struct Entry){
+            .kind = entries[i].kind,
+            .dev = entries[i].dev,
+            .key = entries[i].key,
+            .path = dedup->path,
+            .offset = dedup->offset + entries[i].index * BLOCK_SIZE,
+            .index = entries[i].index,
+        };
+        hashtable_free_batch(&entries[i], 1);
+    }
+
+    hashtable_claim_uncached_batch(stale, stale_count);
+    for (size_t i = 0; i < stale_count; i++)
+        if (stale[i].claimed)
+            dedup->sources[stale[i].index].indexed |=
+                extent ? DEDUP_INDEXED_EXTENT : DEDUP_INDEXED_BLOCK;
+    dedup_resolve_batch(dedup, stale, stale_count, blocks, extent);
+    for (size_t i = 0; i < stale_count; i++)
+        entries[positions[i]] = stale[i];
+
+    free(stale);
+    free(positions);
+}
+
+// Follow runs of matches: a block right after a match most likely continues
+// the same run in the same source file, so it is verified against the
+// predicted location without a lookup.
+void dedup_predict(struct Dedup *dedup, char *in_path, off_t in_offset) {
+    for (size_t i = 0; i < dedup->blocks;) {
+        if (dedup->sources[i].path) {
+            in_path = dedup->sources[i].path;
+            in_offset = dedup->sources[i].offset + BLOCK_SIZE;
+            i++;
+            continue;
+        }
+        if (!in_path) {
+            i++;
+            continue;
+        }
+
+        if (dedup_extent_aligned(dedup, i) &&
+            dedup_resolve(dedup, i, EXTENT_BLOCKS, in_path, in_offset, 0)) {
+            i += EXTENT_BLOCKS;
+            in_offset += EXTENT_SIZE;
+        } else if (dedup_resolve(dedup, i, 1, in_path, in_offset, 0)) {
+            i++;
+            in_offset += BLOCK_SIZE;
+        } else {
+            in_path = NULL;
+            i++;
+        }
+    }
+}
+
+// Look up every extent that is still unresolved, then every remaining block,
+// each level in a single pipelined batch that also claims the keys that are
+// missing for this write. Returns how many `entries` were used, which hold
+// the sources until they are freed.
+size_t dedup_lookup(struct Dedup *dedup, struct Entry *entries) {
+    size_t count = 0;
+    for (size_t i = 0; i + EXTENT_BLOCKS <= dedup->blocks; i++) {
+        if (!dedup_extent_aligned(dedup, i))
+            continue;
+
+        size_t j = 0;
+        while (j < EXTENT_BLOCKS && !dedup->sources[i + j].path)
+            j++;
+        if (j < EXTENT_BLOCKS)
+            continue;
+
+        entries[count++] = (struct Entry){
+            .kind = HASHTABLE_EXTENT,
+            .dev = dedup->dev,
+            .key = calculate_extent_hash(&dedup->hashes[i]),
+            .path = dedup->path,
+            .offset = dedup->offset + i * BLOCK_SIZE,
+            .index = i,
+        };
+    }
+
+    hashtable_claim_batch(entries, count);
+    for (size_t i = 0; i < count; i++)
+        if (entries[i].claimed)
+            dedup->sources[entries[i].index].indexed |= DEDUP_INDEXED_EXTENT;
+    dedup_resolve_batch(dedup, entries, count, EXTENT_BLOCKS, 1);
+    dedup_resolve_stale(dedup, entries, count, EXTENT_BLOCKS, 1);
+    size_t extent_count = count;
+
+    dedup_predict(dedup, NULL, 0);
+
+    for (size_t i = 0; i < dedup->blocks; i++)
+        if (!dedup->sources[i].path)
+            entries[count++] = (struct Entry){
+                .kind = HASHTABLE_BLOCK,
+                .dev = dedup->dev,
+                .key = dedup->hashes[i],
+                .path = dedup->path,
+                .offset = dedup->offset + i * BLOCK_SIZE,
+                .index = i,
+            };
+
+    hashtable_claim_batch(&entries[extent_count], count - extent_count);
+    for (size_t i = extent_count; i < count; i++)
+        if (entries[i].claimed)
+            dedup->sources[entries[i].index].indexed |= DEDUP_INDEXED_BLOCK;
+    dedup_resolve_batch(dedup, &entries[extent_count], count - extent_count,
+                        1, 0);
+    dedup_resolve_stale(dedup, &entries[extent_count], count - extent_count, 1,
+                        0);
+    hashtable_touch_batch(entries, count);
+
+    dedup_predict(dedup, NULL, 0);
+    return count;
+}
+
+// Share `length` bytes at `*in_offset` in `in_fd` with `out_fd` at
+// `*out_offset` if they are still identical, advancing both offsets like
+// `copy_file_range`. The comparison and the sharing happen under the same
+// locks, so nothing written in between can be lost.
+ssize_t dedup_share(int in_fd, off_t *in_offset, int out_fd, off_t *out_offset,
+                    size_t length) {
+    union {
+        struct file_dedupe_range range;
+        unsigned char bytes[sizeof(struct file_dedupe_range) +
+                            sizeof(struct file_dedupe_range_info)];
+    } args = {0};
+    args.range.src_offset = *in_offset;
+    args.range.src_length = length;
+    args.range.dest_count = 1;
+    args.range.info[0].dest_fd = out_fd;
+    args.range.info[0].dest_offset = *out_offset;
+    if (ioctl(in_fd, FIDEDUPERANGE, &args.range) < 0 ||
+        args.range.info[0].status != FILE_DEDUPE_RANGE_SAME)
+        return -1;
+
+    *in_offset += args.range.info[0].bytes_deduped;
+    *out_offset += args.range.info[0].bytes_deduped;
+    return args.range.info[0].bytes_deduped;
+}
+
+// Clone every run of blocks with a contiguous source. Blocks that couldn't be
+// cloned lose their source and are left to `dedup_write`.
+void dedup_clone(struct Dedup *dedup) {
+    for (size_t i = 0; i < dedup->blocks;) {
+        struct Source *source = &dedup->sources[i];
+        size_t j = i + 1;
+        if (!source->path) {
+            i++;
+            continue;
+        }
+        while (j < dedup->blocks && dedup->sources[j].path &&
+               strcmp(dedup->sources[j].path, source->path) == 0 &&
+               dedup->sources[j].offset ==
+                   source->offset + (j - i) * BLOCK_SIZE)
+            j++;
+
+        size_t length = (j - i) * BLOCK_SIZE;
+        size_t written = 0;
+        int in_fd;
+        if ((in_fd = get_working_fd(source->path)) >= 0) {
+            off_t in_offset = source->offset;
+            off_t out_offset = dedup->offset + i * BLOCK_SIZE;
+            while (written < length) {
+                ssize_t copied =
+                    dedup->share
+                        ? dedup_share(in_fd, &in_offset, dedup->fd,
+                                      &out_offset, length - written)
+                        : (*libc_copy_file_range)(in_fd, &in_offset,
+                                                  dedup->fd, &out_offset,
+                                                  length - written, 0);
+                if (copied <= 0)
+                    break;
+                written += copied;
+            }
+            put_working_fd(source->path);
+        }
+        size_t cloned = written / BLOCK_SIZE;
+        dedup_set_sources(dedup, i + cloned, j - i - cloned, NULL, 0, 0);
+        i = j;
+    }
+}
+
+// Write out all runs of blocks without a source in one batch. Returns how
+// many bytes were stored from the start of the write, stopping at the first
+// run that failed.
+ssize_t dedup_write(struct Dedup *dedup) {
+    size_t op_count = 0;
+    struct IoOp *ops = malloc(dedup->blocks * sizeof(struct IoOp));
+    if (!ops)
+        return -1;
+    for (size_t i = 0; i < dedup->blocks; i++) {
+        if (dedup->sources[i].path)
+            continue;
+
+        size_t j = i + 1;
+        while (j < dedup->blocks && !dedup->sources[j].path)
+            j++;
+        ops[op_count++] = (struct IoOp){
+            .fd = dedup->fd,
+            .buf = (void *)&dedup->buf[i * BLOCK_SIZE],
+            .length = (j - i) * BLOCK_SIZE,
+            .offset = dedup->offset + i * BLOCK_SIZE,
+        };
+        i = j;
+    }
+    io_batch(ops, op_count, 1);
+
+    ssize_t total_written = dedup->blocks * BLOCK_SIZE;
+    for (size_t i = 0; i < op_count; i++) {
+        if (ops[i].result == ops[i].length)
+            continue;
+
+        total_written = ops[i].offset - dedup->offset;
+        if (ops[i].result > 0)
+            total_written += ops[i].result;
+        else if (!total_written && ops[i].result < 0) {
+            fprintf(stderr,
+                    "libwritededuper: couldn't write to file descriptor %d: "
+                    "%s\n",
+                    dedup->fd, strerror(-ops[i].result));
+            errno = -ops[i].result;
+            total_written = -1;
+        }
+        break;
+    }
+    free(ops);
+
+    dedup->blocks = total_written > 0 ? total_written / BLOCK_SIZE : 0;
+    return total_written;
+}
+
+// Record the blocks that were written out, and every whole extent that
+// wasn't itself cloned as one, so the next copy can be found. Entries claimed
+// by the lookups already point here.
+void dedup_record(struct Dedup *dedup, struct Entry *entries) {
+    size_t count = 0;
+    for (size_t i = 0; i < dedup->blocks; i++) {
+        off_t offset = dedup->offset + i * BLOCK_SIZE;
+        struct Source *source = &dedup->sources[i];
+        if (!source->path && !(source->indexed & DEDUP_INDEXED_BLOCK))
+            entries[count++] = (struct Entry){
+                .kind = HASHTABLE_BLOCK,
+                .dev = dedup->dev,
+                .key = dedup->hashes[i],
+                .path = dedup->path,
+                .offset = offset,
+            };
+        if (dedup_extent_aligned(dedup, i) && !source->extent &&
+            !(source->indexed & DEDUP_INDEXED_EXTENT))
+            entries[count++] = (struct Entry){
+                .kind = HASHTABLE_EXTENT,
+                .dev = dedup->dev,
+                .key = calculate_extent_hash(&dedup->hashes[i]),
+                .path = dedup->path,
+                .offset = offset,
+            };
+    }
+    hashtable_set_batch(entries, count);
+}
@@ -1,6 +1,8 @@
 #include <dirent.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <time.h>
@@ -15,9 +17,13 @@ struct WorkingFd {
     char *path;
     int fd;
     unsigned long atime;
+    // threads between `get_working_fd` and `put_working_fd`, the fd is only
+    // closed once there are none
+    size_t users;
 };
 
 struct hashmap *working_fds;
+pthread_mutex_t working_fd_lock = PTHREAD_MUTEX_INITIALIZER;
 
 uint64_t working_fd_hash(const void *item, uint64_t seed0, uint64_t seed1) {
     const struct WorkingFd *working_fd = item;
@@ -31,16 +37,23 @@ int working_fd_compare(const void *a, const void *b, void *data) {
     return strcmp(aa->path, bb->path);
 }
 
+// Open `path` for reading, or reuse the fd it was opened with before. The
+// caller hands it back with `put_working_fd` once done with it.
 int get_working_fd(char *path) {
     unsigned long current_time = time(NULL);
 
+    pthread_mutex_lock(&working_fd_lock);
     if (hashmap_count(working_fds) >= GC_TRIGGER) {
         size_t iter = 0;
         void *item;
         while (hashmap_iter(working_fds, &iter, &item)) {
-            const struct WorkingFd *old_fd = item;
-            if (current_time - old_fd->atime > GC_MAX_AGE)
-                hashmap_delete(working_fds, old_fd);
+            struct WorkingFd old_fd = *(struct WorkingFd *)item;
+            if (!old_fd.users && current_time - old_fd.atime > GC_MAX_AGE) {
+                hashmap_delete(working_fds, &old_fd);
+                close(old_fd.fd);
+                free(old_fd.path);
+                iter = 0;
+            }
         }
     }
 
@@ -49,16 +62,43 @@ int get_working_fd(char *path) {
 
     if (!working_fd) {
         int fd;
-        if ((fd = open(path, O_RDONLY)) < 0)
+        if ((fd = open(path, O_RDONLY)) < 0) {
+            pthread_mutex_unlock(&working_fd_lock);
             return fd;
+        }
+        char *working_path;
+        if (!(working_path = strdup(path))) {
+            pthread_mutex_unlock(&working_fd_lock);
+            close(fd);
+            return -1;
+        }
         struct WorkingFd *new_working_fd =
-            &(struct WorkingFd){.path = path, .fd = fd, .atime = current_time};
+            &(struct WorkingFd){.path = working_path,
+                                .fd = fd,
+                                .atime = current_time,
+                                .users = 1};
         hashmap_set(working_fds, new_working_fd);
+        pthread_mutex_unlock(&working_fd_lock);
         return fd;
     }
 
-    struct WorkingFd *new_working_fd = &(struct WorkingFd){
-        .path = working_fd->path, .fd = working_fd->fd, .atime = current_time};
-    hashmap_set(working_fds, working_fd);
-    return working_fd->fd;
+    struct WorkingFd new_working_fd = *working_fd;
+    new_working_fd.atime = current_time;
+    new_working_fd.users++;
+    hashmap_set(working_fds, &new_working_fd);
+    pthread_mutex_unlock(&working_fd_lock);
+    return new_working_fd.fd;
+}
+
+// Hand back the fd `get_working_fd` returned for `path`.
+void put_working_fd(char *path) {
+    pthread_mutex_lock(&working_fd_lock);
+    const struct WorkingFd *working_fd =
+        hashmap_get(working_fds, &(struct WorkingFd){.path = path});
+    if (working_fd && working_fd->users) {
+        struct WorkingFd new_working_fd = *working_fd;
+        new_working_fd.users--;
+        hashmap_set(working_fds, &new_working_fd);
+    }
+    pthread_mutex_unlock(&working_fd_lock);
 }
@@ -0,0 +1,270 @@
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "crc32.c"
+#include "fd.c"
+#include "hashmap/hashmap.c"
+#include "hashtable.c"
+#include "hiredis/hiredis.h"
+#include "uring.c"
+
+static ssize_t (*libc_pwrite)(int fd, const void *buf, size_t count,
+                              off_t offset) = pwrite;
+static ssize_t (*libc_pread)(int fd, void *buf, size_t count,
+                             off_t offset) = pread;
+static ssize_t (*libc_copy_file_range)(int in_fd, off_t *in_offset,
+                                       int out_fd, off_t *out_offset,
+                                       size_t length,
+                                       unsigned int flags) = copy_file_range;
+
+#include "dedup.c"
+
+// Remove a candidate only if it wasn't recorded again since it was found
+// dead, which would have changed its score.
+#define GC_DELETE_SCRIPT                                                       \
+    "if redis.call('ZSCORE', KEYS[1], ARGV[1]) == ARGV[2] then "               \
+    "return redis.call('ZREM', KEYS[1], ARGV[1]) end return 0"
+
+struct GcStats {
+    unsigned long scanned;
+    unsigned long dead;
+    unsigned long deleted;
+};
+
+int gc_stat_only = 0;
+int gc_dry_run = 0;
+
+#define GC_KEY_CURRENT 1
+#define GC_KEY_LEGACY 2
+
+// Parse a key written by `hashtable_key`, returning GC_KEY_LEGACY for the
+// `<fingerprint>` keys of versions that didn't namespace them by filesystem,
+// and 0 for keys that aren't index entries.
+int gc_parse_key(const char *key, struct Entry *entry) {
+    entry->kind = HASHTABLE_BLOCK;
+    if (*key == *HASHTABLE_EXTENT) {
+        entry->kind = HASHTABLE_EXTENT;
+        key++;
+    }
+    if (!isdigit(*key))
+        return 0;
+
+    unsigned long dev;
+    int consumed;
+    if (sscanf(key, "%lu:%u%n", &dev, &entry->key, &consumed) == 2 &&
+        !key[consumed]) {
+        entry->dev = dev;
+        return GC_KEY_CURRENT;
+    }
+    if (sscanf(key, "%u%n", &entry->key, &consumed) == 1 && !key[consumed])
+        return GC_KEY_LEGACY;
+    return 0;
+}
+
+// Whether the entry still points at its content. Entries that can't be
+// checked right now count as alive.
+int gc_alive(struct Entry *entry) {
+    size_t blocks =
+        strcmp(entry->kind, HASHTABLE_EXTENT) == 0 ? EXTENT_BLOCKS : 1;
+
+    struct stat st;
+    if (stat(entry->path, &st) < 0)
+        return errno != ENOENT && errno != ENOTDIR;
+    if (!S_ISREG(st.st_mode) ||
+        entry->offset + (off_t)(blocks * BLOCK_SIZE) > st.st_size)
+        return 0;
+
+    // the filesystem is identified through a descriptor
+    int fd;
+    if ((fd = open(entry->path, O_RDONLY | O_NONBLOCK)) < 0)
+        return errno != ENOENT;
+    if (dedup_filesystem(fd, st.st_dev) != entry->dev) {
+        close(fd);
+        return 0;
+    }
+    if (gc_stat_only) {
+        close(fd);
+        return 1;
+    }
+
+    unsigned char buf[EXTENT_SIZE];
+    ssize_t length = pread(fd, buf, blocks * BLOCK_SIZE, entry->offset);
+    close(fd);
+    if (length < (ssize_t)(blocks * BLOCK_SIZE))
+        return length < 0;
+
+    uint32_t hashes[EXTENT_BLOCKS];
+    for (size_t i = 0; i < blocks; i++)
+        hashes[i] = calculate_crc32c(0, &buf[i * BLOCK_SIZE], BLOCK_SIZE);
+    return (blocks == 1 ? hashes[0] : calculate_extent_hash(hashes)) ==
+           entry->key;
+}
+
+// Validate every candidate of one batch of keys from SCAN, removing the dead
+// ones. Keys still holding a single location from before candidates were
+// kept, and keys from before they were namespaced by filesystem, are deleted
+// outright, as they are never looked up.
+void gc_batch(redisContext *c, redisReply *keys, struct GcStats *stats) {
+    struct Entry *entries = calloc(keys->elements, sizeof(struct Entry));
+    if (!entries)
+        return;
+
+    size_t count = 0;
+    for (size_t i = 0; i < keys->elements; i++)
+        if (gc_parse_key(keys->element[i]->str, &entries[count]) ==
+            GC_KEY_CURRENT) {
+            entries[count].index = i;
+            redisAppendCommand(c, "ZRANGE %s 0 -1 WITHSCORES",
+                               keys->element[i]->str);
+            count++;
+        }
+
+    // keys of versions that didn't namespace them by filesystem, whose replies
+    // come after those of the ranges, with the other deletes
+    size_t deletes = 0;
+    struct Entry legacy;
+    for (size_t i = 0; i < keys->elements; i++)
+        if (gc_parse_key(keys->element[i]->str, &legacy) == GC_KEY_LEGACY) {
+            stats->scanned++;
+            stats->dead++;
+            if (!gc_dry_run) {
+                redisAppendCommand(c, "DEL %s", keys->element[i]->str);
+                deletes++;
+            }
+        }
+
+    for (size_t i = 0; i < count; i++) {
+        if (redisGetReply(c, (void **)&entries[i].reply) != REDIS_OK) {
+            entries[i].reply = NULL;
+            continue;
+        }
+        redisReply *reply = entries[i].reply;
+        char *key = keys->element[entries[i].index]->str;
+        if (reply->type == REDIS_REPLY_ERROR &&
+            strncmp(reply->str, "WRONGTYPE", 9) == 0) {
+            stats->scanned++;
+            stats->dead++;
+            if (!gc_dry_run) {
+                redisAppendCommand(c, "DEL %s", key);
+                deletes++;
+            }
+            continue;
+        }
+        if (reply->type != REDIS_REPLY_ARRAY)
+            continue;
+
+        for (size_t j = 0; j + 1 < reply->elements; j += 2) {
+            redisReply *member = reply->element[j];
+            entries[i].path = member->str;
+            entries[i].offset =
+                strtoul(&member->str[strlen(member->str) + 1], NULL, 10);
+            stats->scanned++;
+            if (gc_alive(&entries[i]))
+                continue;
+
+            stats->dead++;
+            if (!gc_dry_run) {
+                redisAppendCommand(c, "EVAL %s 1 %s %b %s", GC_DELETE_SCRIPT,
+                                   key, member->str, member->len,
+                                   reply->element[j + 1]->str);
+                deletes++;
+            }
+        }
+    }
+
+    redisReply *reply;
+    for (size_t i = 0; i < deletes; i++)
+        if (redisGetReply(c, (void **)&reply) == REDIS_OK) {
+            if (reply->type == REDIS_REPLY_INTEGER && reply->integer)
+                stats->deleted++;
+            freeReplyObject(reply);
+        }
+
+    hashtable_free_batch(entries, count);
+    free(entries);
+}
+
+int gc_shard(struct Shard *shard, unsigned long batch, struct GcStats *stats) {
+    if (!shard->c) {
+        fprintf(stderr, "libwritededuper-gc: couldn't connect to redis on %s\n",
+                shard->host);
+        return 0;
+    }
+
+    char cursor[32] = "0";
+    do {
+        redisReply *reply =
+            redisCommand(shard->c, "SCAN %s COUNT %lu", cursor, batch);
+        if (!reply || reply->type != REDIS_REPLY_ARRAY ||
+            reply->elements != 2) {
+            fprintf(stderr, "libwritededuper-gc: couldn't scan redis on %s: "
+                            "%s\n",
+                    shard->host,
+                    reply && reply->type == REDIS_REPLY_ERROR
+                        ? reply->str
+                        : shard->c->errstr);
+            freeReplyObject(reply);
+            return 0;
+        }
+
+        strlcpy(cursor, reply->element[0]->str, sizeof(cursor));
+        gc_batch(shard->c, reply->element[1], stats);
+        freeReplyObject(reply);
+    } while (strcmp(cursor, "0") != 0);
+    return 1;
+}
+
+void usage(char *name) {
+    fprintf(stderr,
+            "usage: %s [-c count] [-s] [-n]\n"
+            "  -c  keys per SCAN batch (1000)\n"
+            "  -s  only check that files exist and are large enough, "
+            "without reading them\n"
+            "  -n  report dead entries without deleting them\n",
+            name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    unsigned long batch = 1000;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:sn")) != -1) {
+        switch (opt) {
+        case 'c':
+            if (!(batch = strtoul(optarg, NULL, 10)))
+                usage(argv[0]);
+            break;
+        case 's':
+            gc_stat_only = 1;
+            break;
+        case 'n':
+            gc_dry_run = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    // a whole batch is read and checked between replies
+    setenv("LIBWRITEDEDUPER_REDIS_TIMEOUT_MS", "10000", 0);
+    hashtable_init();
+
+    struct GcStats stats = {0};
+    int ok = 1;
+    for (size_t i = 0; i < shard_count; i++)
+        ok &= gc_shard(&shards[i], batch, &stats);
+
+    printf("scanned %lu candidates, %lu dead, %lu deleted\n", stats.scanned,
+           stats.dead, stats.deleted);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
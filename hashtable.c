@@ -1,47 +1,616 @@
+#include <errno.h>
 #include <linux/limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#include "bloom.c"
+#include "cache.c"
 #include "hiredis/hiredis.h"
 
-redisContext *c;
+#define SHARD_POINTS 160
+#define SHARD_MIN_BACKOFF_MS 100
+#define SHARD_MAX_BACKOFF_MS 30000
 
-void hashtable_set(unsigned int key, char *path, off_t offset) {
-    char value[PATH_MAX + 11] = {0};
-    unsigned long copied = strlcpy(value, path, PATH_MAX - 1);
-    sprintf(&value[copied + 1], "%ld", offset);
+// A shard without a context is down: its keys are treated as misses and
+// never recorded, until the reconnection thread brings it back.
+struct Shard {
+    char *host;
+    int port;
+    redisContext *c;
+    long backoff_ms;
+    struct timespec retry_at;
+};
 
-    redisReply *reply = redisCommand(c, "SET %u %b", key, value);
-    freeReplyObject(reply);
-}
+struct ShardPoint {
+    uint64_t point;
+    size_t shard;
+};
 
-void hashtable_init() {
-    char *host;
-    if (!(host = getenv("LIBWRITEDEDUPER_REDIS_HOST")))
-        host = "127.0.0.1";
+struct Shard *shards = NULL;
+size_t shard_count;
+struct ShardPoint *shard_points;
 
-    int is_unix = 0, port;
-    char *str_port;
-    if ((str_port = getenv("LIBWRITEDEDUPER_REDIS_PORT")))
-        port = atoi(str_port);
-    else
-        is_unix = 1;
+pthread_mutex_t hashtable_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t hashtable_reconnect = PTHREAD_COND_INITIALIZER;
+int hashtable_reconnecting = 0;
+int hashtable_forked = 0;
+struct timeval hashtable_timeout;
+long hashtable_ttl = 0;
+long hashtable_candidates = 4;
+
+void hashtable_init();
+
+#define HASHTABLE_BLOCK ""
+#define HASHTABLE_EXTENT "x"
+#define HASHTABLE_KEY_SIZE 48
+
+// Each key holds a sorted set of up to LIBWRITEDEDUPER_CANDIDATES locations,
+// scored by when they were last recorded or cloned from, so that a deleted or
+// rewritten file doesn't hide the other copies of the same content. All
+// scripts take the location, the current time, the number of candidates and
+// the TTL.
+#define HASHTABLE_CLAIM_SCRIPT                                                 \
+    "local found = redis.call('ZREVRANGE', KEYS[1], 0, ARGV[3] - 1) "          \
+    "if #found == 0 then redis.call('ZADD', KEYS[1], ARGV[2], ARGV[1]) "       \
+    "if ARGV[4] ~= '0' then redis.call('EXPIRE', KEYS[1], ARGV[4]) end end "   \
+    "return found"
+#define HASHTABLE_RECORD_SCRIPT                                                \
+    "redis.call('ZADD', KEYS[1], ARGV[2], ARGV[1]) "                           \
+    "redis.call('ZREMRANGEBYRANK', KEYS[1], 0, -ARGV[3] - 1) "                 \
+    "if ARGV[4] ~= '0' then redis.call('EXPIRE', KEYS[1], ARGV[4]) end "       \
+    "return 1"
+#define HASHTABLE_TOUCH_SCRIPT                                                 \
+    "redis.call('ZADD', KEYS[1], 'XX', ARGV[2], ARGV[1]) "                     \
+    "if ARGV[4] ~= '0' then redis.call('EXPIRE', KEYS[1], ARGV[4]) end "       \
+    "return 1"
+
+#define HASHTABLE_CLAIM 0
+#define HASHTABLE_RECORD 1
+#define HASHTABLE_TOUCH 2
+#define HASHTABLE_SCRIPTS 3
+
+static const char *hashtable_script_sources[HASHTABLE_SCRIPTS] = {
+    HASHTABLE_CLAIM_SCRIPT, HASHTABLE_RECORD_SCRIPT, HASHTABLE_TOUCH_SCRIPT};
+char hashtable_scripts[HASHTABLE_SCRIPTS][41];
+
+// Keys are namespaced by the filesystem of the file they point to, as clones
+// can't cross filesystems, so each filesystem has its own candidates for a
+// fingerprint. `path` and `offset` are the candidate being tried.
+struct Entry {
+    const char *kind;
+    // from `dedup_filesystem`: its UUID, else its `statfs` id, else the device
+    dev_t dev;
+    unsigned int key;
+    char *path;
+    off_t offset;
+    redisReply *reply;
+    int claimed;
+    // `path` is an owned copy of the location the local cache had, and the
+    // index wasn't asked
+    int cached;
+    // set by callers on the candidate that was verified, to rank it first
+    // and keep it from expiring
+    int used;
+    // not used by the index, for callers to map entries back to their data
+    size_t index;
+};
+
+// The shard owning a key is the first point clockwise from the key's own
+// point on a ring holding SHARD_POINTS points per shard, placed by the
+// shard's address so adding one only moves the keys it takes over.
+struct Shard *hashtable_shard(const struct Entry *entry) {
+    if (shard_count == 1)
+        return &shards[0];
+
+    uint64_t point = bloom_mix(
+        bloom_hash(entry->kind, entry->dev, entry->key) ^ 0x5bd1e995);
+    size_t low = 0, high = shard_count * SHARD_POINTS;
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        if (shard_points[middle].point < point)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return &shards[shard_points[low % (shard_count * SHARD_POINTS)].shard];
+}
 
-    struct timeval timeout = {1, 0};
-    if (is_unix)
-        c = redisConnectUnixWithTimeout(host, timeout);
+redisContext *hashtable_connect(struct Shard *shard) {
+    redisContext *c;
+    if (!shard->port)
+        c = redisConnectUnixWithTimeout(shard->host, hashtable_timeout);
     else
-        c = redisConnectWithTimeout(host, port, timeout);
+        c = redisConnectWithTimeout(shard->host, shard->port,
+                                    hashtable_timeout);
 
     if (!c || c->err) {
-        if (c) {
-            fprintf(stderr, "libwritededuper: redis connection error: %s\n",
-                    c->errstr);
+        if (c)
+            redisFree(c);
+        return NULL;
+    }
+    // every reply has to arrive within the budget, or the shard is dropped
+    redisSetTimeout(c, hashtable_timeout);
+
+    for (int i = 0; i < HASHTABLE_SCRIPTS; i++) {
+        redisReply *reply =
+            redisCommand(c, "SCRIPT LOAD %s", hashtable_script_sources[i]);
+        if (!reply || reply->type != REDIS_REPLY_STRING) {
+            freeReplyObject(reply);
             redisFree(c);
-        } else
-            fprintf(stderr, "libwritededuper: redis connection error: can't "
-                            "allocate redis context\n");
-        exit(EXIT_FAILURE);
+            return NULL;
+        }
+        strlcpy(hashtable_scripts[i], reply->str, sizeof(*hashtable_scripts));
+        freeReplyObject(reply);
+    }
+    return c;
+}
+
+void *hashtable_reconnect_worker(void *arg) {
+    pthread_mutex_lock(&hashtable_lock);
+    for (;;) {
+        struct timespec now, wake = {0};
+        clock_gettime(CLOCK_REALTIME, &now);
+
+        for (size_t i = 0; i < shard_count; i++) {
+            struct Shard *shard = &shards[i];
+            if (shard->c)
+                continue;
+
+            if (shard->retry_at.tv_sec < now.tv_sec ||
+                (shard->retry_at.tv_sec == now.tv_sec &&
+                 shard->retry_at.tv_nsec <= now.tv_nsec)) {
+                pthread_mutex_unlock(&hashtable_lock);
+                redisContext *c = hashtable_connect(shard);
+                pthread_mutex_lock(&hashtable_lock);
+
+                if ((shard->c = c)) {
+                    fprintf(stderr,
+                            "libwritededuper: reconnected to redis on %s\n",
+                            shard->host);
+                    shard->backoff_ms = SHARD_MIN_BACKOFF_MS;
+                    continue;
+                }
+
+                clock_gettime(CLOCK_REALTIME, &now);
+                shard->retry_at = now;
+                shard->retry_at.tv_sec += shard->backoff_ms / 1000;
+                shard->retry_at.tv_nsec += (shard->backoff_ms % 1000) * 1000000;
+                if (shard->retry_at.tv_nsec >= 1000000000) {
+                    shard->retry_at.tv_sec++;
+                    shard->retry_at.tv_nsec -= 1000000000;
+                }
+                if ((shard->backoff_ms *= 2) > SHARD_MAX_BACKOFF_MS)
+                    shard->backoff_ms = SHARD_MAX_BACKOFF_MS;
+            }
+
+            if (!wake.tv_sec || shard->retry_at.tv_sec < wake.tv_sec ||
+                (shard->retry_at.tv_sec == wake.tv_sec &&
+                 shard->retry_at.tv_nsec < wake.tv_nsec))
+                wake = shard->retry_at;
+        }
+
+        if (wake.tv_sec)
+            pthread_cond_timedwait(&hashtable_reconnect, &hashtable_lock,
+                                   &wake);
+        else
+            pthread_cond_wait(&hashtable_reconnect, &hashtable_lock);
     }
+    return NULL;
+}
+
+// Have the reconnection thread retry `shard` right away, starting it if it
+// isn't running. Must be called with the lock held.
+void hashtable_schedule(struct Shard *shard) {
+    shard->backoff_ms = SHARD_MIN_BACKOFF_MS;
+    clock_gettime(CLOCK_REALTIME, &shard->retry_at);
+
+    if (!hashtable_reconnecting) {
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        hashtable_reconnecting =
+            !pthread_create(&thread, &attr, hashtable_reconnect_worker, NULL);
+        pthread_attr_destroy(&attr);
+    }
+    pthread_cond_signal(&hashtable_reconnect);
+}
+
+// Open the breaker of a shard that failed or went over budget. Must be called
+// with the lock held.
+void hashtable_trip(struct Shard *shard) {
+    if (!shard->c)
+        return;
+
+    fprintf(stderr,
+            "libwritededuper: redis on %s unavailable (%s), passing writes "
+            "through\n",
+            shard->host, shard->c->err ? shard->c->errstr : "no reply");
+    redisFree(shard->c);
+    shard->c = NULL;
+    hashtable_schedule(shard);
+}
+
+// Connect to every shard, leaving the ones that can't be reached to the
+// reconnection thread. Must be called with the lock held.
+void hashtable_connect_all(void) {
+    for (size_t i = 0; i < shard_count; i++) {
+        if (shards[i].c)
+            redisFree(shards[i].c);
+        if (!(shards[i].c = hashtable_connect(&shards[i]))) {
+            fprintf(stderr,
+                    "libwritededuper: couldn't connect to redis on %s, "
+                    "passing writes through until it's back\n",
+                    shards[i].host);
+            hashtable_schedule(&shards[i]);
+        }
+    }
+    hashtable_forked = 0;
+}
+
+// Whether any shard is up, connecting on first use.
+int hashtable_available(void) {
+    if (!shards)
+        hashtable_init();
+
+    for (size_t i = 0; i < shard_count; i++)
+        if (__atomic_load_n(&shards[i].c, __ATOMIC_RELAXED))
+            return 1;
+    return 0;
+}
+
+// Send everything appended to every shard, so that they all work on their
+// part of a batch while the first replies are being read.
+void hashtable_flush(void) {
+    for (size_t i = 0; i < shard_count; i++) {
+        int done = 0;
+        while (shards[i].c && !done)
+            if (redisBufferWrite(shards[i].c, &done) != REDIS_OK)
+                hashtable_trip(&shards[i]);
+    }
+}
+
+void hashtable_key(char *key, const struct Entry *entry) {
+    sprintf(key, "%s%lu:%u", entry->kind, (unsigned long)entry->dev,
+            entry->key);
+}
+
+size_t hashtable_format(char *value, struct Entry *entry) {
+    unsigned long copied = strlcpy(value, entry->path, PATH_MAX - 1);
+    return copied + 1 + sprintf(&value[copied + 1], "%ld", entry->offset);
+}
+
+void hashtable_append_script(redisContext *c, int script, const char *key,
+                             struct Entry *entry) {
+    char value[PATH_MAX + 21] = {0};
+    size_t length = hashtable_format(value, entry);
+    redisAppendCommand(c, "EVALSHA %s 1 %s %b %ld %ld %ld",
+                       hashtable_scripts[script], key, value, length,
+                       (long)time(NULL), hashtable_candidates, hashtable_ttl);
+}
+
+// Point `entry` at its `candidate`th most recently used location, if it has
+// that many.
+int hashtable_candidate(struct Entry *entry, size_t candidate) {
+    if (entry->cached)
+        return candidate == 0;
+
+    redisReply *reply = entry->reply;
+    if (!reply || reply->type != REDIS_REPLY_ARRAY ||
+        candidate >= reply->elements ||
+        reply->element[candidate]->type != REDIS_REPLY_STRING)
+        return 0;
+
+    entry->path = reply->element[candidate]->str;
+    entry->offset = strtoul(&entry->path[strlen(entry->path) + 1], NULL, 10);
+    return 1;
+}
+
+// Look up all `entries` in one pipelined round trip per shard, atomically
+// recording each entry's own `path` and `offset` wherever the index has
+// nothing yet, so that writers of the same content find each other and a miss
+// costs no second round trip. `claimed` tells which were. Hits point `path` at
+// their best candidate and keep the others in their reply until
+// `hashtable_free_batch`, misses leave it NULL. Entries the local cache knows
+// are hits without a lookup, and the entries of shards that are down misses.
+// Entries the bloom filter has never seen are misses that aren't sent at all,
+// and are recorded with the rest of the write by `hashtable_set_batch`. The
+// local cache is skipped unless `cached`.
+void hashtable_claim(struct Entry *entries, size_t count, int cached) {
+    if (!shards)
+        hashtable_init();
+
+    char *queued;
+    if (!shard_count || !(queued = malloc(count))) {
+        for (size_t i = 0; i < count; i++)
+            entries[i] = (struct Entry){.index = entries[i].index};
+        return;
+    }
+
+    pthread_mutex_lock(&hashtable_lock);
+    if (hashtable_forked)
+        hashtable_connect_all();
+
+    char key[HASHTABLE_KEY_SIZE];
+    for (size_t i = 0; i < count; i++) {
+        struct Entry *entry = &entries[i];
+        redisContext *c = hashtable_shard(entry)->c;
+        queued[i] = bloom_contains(entry->kind, entry->dev, entry->key);
+        if ((entry->cached =
+                 cached &&
+                 cache_get(bloom_hash(entry->kind, entry->dev, entry->key),
+                           &entry->path, &entry->offset)) ||
+            !c || !queued[i]) {
+            queued[i] = 0;
+            continue;
+        }
+
+        hashtable_key(key, entry);
+        hashtable_append_script(c, HASHTABLE_CLAIM, key, entry);
+    }
+    hashtable_flush();
+
+    for (size_t i = 0; i < count; i++) {
+        struct Shard *shard = hashtable_shard(&entries[i]);
+        char *path = entries[i].path;
+        off_t offset = entries[i].offset;
+        entries[i].reply = NULL;
+        entries[i].claimed = 0;
+        entries[i].used = 0;
+        if (entries[i].cached)
+            continue;
+        entries[i].path = NULL;
+        if (!queued[i] || !shard->c)
+            continue;
+        if (redisGetReply(shard->c, (void **)&entries[i].reply) != REDIS_OK) {
+            entries[i].reply = NULL;
+            hashtable_trip(shard);
+            continue;
+        }
+
+        redisReply *reply = entries[i].reply;
+        if (reply->type == REDIS_REPLY_ERROR) {
+            // the scripts are gone if the server was flushed, and reconnecting
+            // loads them again
+            if (strncmp(reply->str, "NOSCRIPT", 8) == 0)
+                hashtable_trip(shard);
+        } else if (!hashtable_candidate(&entries[i], 0)) {
+            entries[i].claimed = 1;
+            cache_put(bloom_hash(entries[i].kind, entries[i].dev,
+                                 entries[i].key),
+                      path, offset);
+        }
+    }
+    pthread_mutex_unlock(&hashtable_lock);
+    free(queued);
+}
+
+void hashtable_claim_batch(struct Entry *entries, size_t count) {
+    hashtable_claim(entries, count, 1);
+}
+
+// Like `hashtable_claim_batch`, for entries whose cached location turned out
+// to be stale, so that the index's own candidates still get a chance.
+void hashtable_claim_uncached_batch(struct Entry *entries, size_t count) {
+    hashtable_claim(entries, count, 0);
+}
+
+// Save the local cache as a snapshot, if it is due or `force`d, for processes
+// about to exit. Only copying the cache out and mapping the result hold the
+// lock.
+void hashtable_save(int force) {
+    if (!shard_count)
+        return;
+
+    pthread_mutex_lock(&hashtable_lock);
+    struct CacheSave *save = cache_save_begin(force);
+    pthread_mutex_unlock(&hashtable_lock);
+    if (!save)
+        return;
+
+    int saved = cache_save_write(save);
+    pthread_mutex_lock(&hashtable_lock);
+    cache_save_end(save, saved);
+    pthread_mutex_unlock(&hashtable_lock);
+}
+
+void hashtable_set_batch(struct Entry *entries, size_t count) {
+    if (!shards)
+        hashtable_init();
+    if (!shard_count)
+        return;
+
+    pthread_mutex_lock(&hashtable_lock);
+    if (hashtable_forked)
+        hashtable_connect_all();
+
+    char key[HASHTABLE_KEY_SIZE];
+    for (size_t i = 0; i < count; i++) {
+        struct Entry *entry = &entries[i];
+        redisContext *c = hashtable_shard(entry)->c;
+        if (!c)
+            continue;
+        hashtable_key(key, entry);
+        hashtable_append_script(c, HASHTABLE_RECORD, key, entry);
+        bloom_add(entry->kind, entry->dev, entry->key);
+        cache_put(bloom_hash(entry->kind, entry->dev, entry->key),
+                  entry->path, entry->offset);
+    }
+    hashtable_flush();
+
+    // entries appended before their shard tripped are simply lost
+    redisReply *reply;
+    for (size_t i = 0; i < count; i++) {
+        struct Shard *shard = hashtable_shard(&entries[i]);
+        if (!shard->c)
+            continue;
+        if (redisGetReply(shard->c, (void **)&reply) != REDIS_OK)
+            hashtable_trip(shard);
+        else
+            freeReplyObject(reply);
+    }
+    pthread_mutex_unlock(&hashtable_lock);
+    hashtable_save(0);
+}
+
+// Rank the candidate every used entry points at first, and restart its
+// key's expiry. Entries found in the local cache are only touched when they
+// could expire, the ranking of the others can wait until they are looked up.
+void hashtable_touch_batch(struct Entry *entries, size_t count) {
+    if (!shard_count)
+        return;
+
+    size_t used = 0;
+    for (size_t i = 0; i < count; i++)
+        used += entries[i].used;
+    if (!used)
+        return;
+
+    pthread_mutex_lock(&hashtable_lock);
+    char key[HASHTABLE_KEY_SIZE];
+    for (size_t i = 0; i < count; i++) {
+        redisContext *c = hashtable_shard(&entries[i])->c;
+        if (!entries[i].used)
+            continue;
+        cache_put(bloom_hash(entries[i].kind, entries[i].dev, entries[i].key),
+                  entries[i].path, entries[i].offset);
+        if ((entries[i].cached && !hashtable_ttl) || !c)
+            continue;
+        hashtable_key(key, &entries[i]);
+        hashtable_append_script(c, HASHTABLE_TOUCH, key, &entries[i]);
+    }
+    hashtable_flush();
+
+    redisReply *reply;
+    for (size_t i = 0; i < count; i++) {
+        struct Shard *shard = hashtable_shard(&entries[i]);
+        if (!entries[i].used || (entries[i].cached && !hashtable_ttl) ||
+            !shard->c)
+            continue;
+        if (redisGetReply(shard->c, (void **)&reply) != REDIS_OK)
+            hashtable_trip(shard);
+        else
+            freeReplyObject(reply);
+    }
+    pthread_mutex_unlock(&hashtable_lock);
+}
+
+void hashtable_free_batch(struct Entry *entries, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (entries[i].reply)
+            freeReplyObject(entries[i].reply);
+        if (entries[i].cached)
+            free(entries[i].path);
+    }
+}
+
+int shard_point_compare(const void *a, const void *b) {
+    const struct ShardPoint *aa = a;
+    const struct ShardPoint *bb = b;
+    return aa->point < bb->point ? -1 : aa->point > bb->point;
+}
+
+// Parse LIBWRITEDEDUPER_REDIS_HOSTS, a comma separated list of `host:port`
+// and unix socket paths, falling back to LIBWRITEDEDUPER_REDIS_HOST and
+// LIBWRITEDEDUPER_REDIS_PORT for a single server.
+void hashtable_parse_shards(void) {
+    char *hosts;
+    if (!(hosts = getenv("LIBWRITEDEDUPER_REDIS_HOSTS"))) {
+        char *host;
+        if (!(host = getenv("LIBWRITEDEDUPER_REDIS_HOST")))
+            host = "127.0.0.1";
+
+        int port = 0;
+        char *str_port;
+        if ((str_port = getenv("LIBWRITEDEDUPER_REDIS_PORT")))
+            port = atoi(str_port);
+
+        shard_count = 1;
+        shards = calloc(1, sizeof(struct Shard));
+        shards[0] = (struct Shard){.host = strdup(host), .port = port};
+        return;
+    }
+
+    shard_count = 1;
+    for (char *p = hosts; *p; p++)
+        if (*p == ',')
+            shard_count++;
+    shards = calloc(shard_count, sizeof(struct Shard));
+
+    char *copy = strdup(hosts), *saveptr, *host;
+    shard_count = 0;
+    for (host = strtok_r(copy, ",", &saveptr); host;
+         host = strtok_r(NULL, ",", &saveptr)) {
+        char *colon;
+        int port = 0;
+        if (host[0] != '/' && (colon = strrchr(host, ':'))) {
+            *colon = 0;
+            port = atoi(colon + 1);
+        }
+        shards[shard_count++] = (struct Shard){.host = strdup(host),
+                                               .port = port};
+    }
+    free(copy);
+}
+
+// A forked child must not talk over its parent's connections, nor wait on a
+// reconnection thread it doesn't have, so it reconnects on its first batch.
+void hashtable_atfork_child(void) {
+    pthread_mutex_init(&hashtable_lock, NULL);
+    pthread_cond_init(&hashtable_reconnect, NULL);
+    hashtable_reconnecting = 0;
+    hashtable_forked = 1;
+}
+
+void hashtable_init() {
+    pthread_mutex_lock(&hashtable_lock);
+    if (shards) {
+        pthread_mutex_unlock(&hashtable_lock);
+        return;
+    }
+
+    long timeout_ms = 100;
+    char *str_timeout;
+    if ((str_timeout = getenv("LIBWRITEDEDUPER_REDIS_TIMEOUT_MS")))
+        timeout_ms = atol(str_timeout);
+    char *str_ttl;
+    if ((str_ttl = getenv("LIBWRITEDEDUPER_TTL")))
+        hashtable_ttl = atol(str_ttl);
+    char *str_candidates;
+    if ((str_candidates = getenv("LIBWRITEDEDUPER_CANDIDATES")) &&
+        (hashtable_candidates = atol(str_candidates)) < 1)
+        hashtable_candidates = 1;
+    hashtable_timeout =
+        (struct timeval){timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+
+    bloom_init();
+    cache_init();
+    hashtable_parse_shards();
+    if (!shard_count)
+        fprintf(stderr, "libwritededuper: no redis servers configured, "
+                        "passing writes through\n");
+
+    shard_points =
+        malloc(shard_count * SHARD_POINTS * sizeof(struct ShardPoint));
+    for (size_t i = 0; i < shard_count; i++)
+        for (int j = 0; j < SHARD_POINTS; j++) {
+            char name[PATH_MAX + 32];
+            int length =
+                snprintf(name, sizeof(name), "%s:%d#%d", shards[i].host,
+                         shards[i].port, j);
+            shard_points[i * SHARD_POINTS + j] = (struct ShardPoint){
+                .point = bloom_mix(
+                    calculate_crc32c(0, (unsigned char *)name, length)),
+                .shard = i,
+            };
+        }
+    qsort(shard_points, shard_count * SHARD_POINTS, sizeof(struct ShardPoint),
+          shard_point_compare);
+
+    hashtable_connect_all();
+    pthread_atfork(NULL, NULL, hashtable_atfork_child);
+    pthread_mutex_unlock(&hashtable_lock);
 }
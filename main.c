@@ -1,12 +1,14 @@
 #define _GNU_SOURCE
 
 #include <dlfcn.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <linux/limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -16,15 +18,41 @@
 #include "hashmap/hashmap.c"
 #include "hashtable.c"
 #include "hiredis/hiredis.h"
-
-#define BLOCK_SIZE 4096
+#include "pool.c"
+#include "stream.c"
+#include "uring.c"
 
 static int libwritededuper_ready = 0;
 
-static int (*libc_write)(int fd, const void *buf, size_t count);
-static int (*libc_pwrite)(int fd, const void *buf, size_t count, off_t offset);
-static int (*libc_read)(int fd, void *buf, size_t count);
-static int (*libc_pread)(int fd, void *buf, size_t count, off_t offset);
+static ssize_t (*libc_write)(int fd, const void *buf, size_t count);
+static ssize_t (*libc_pwrite)(int fd, const void *buf, size_t count,
+                              off_t offset);
+static ssize_t (*libc_read)(int fd, void *buf, size_t count);
+static ssize_t (*libc_pread)(int fd, void *buf, size_t count, off_t offset);
+static ssize_t (*libc_sendfile)(int out_fd, int in_fd, off_t *offset,
+                                size_t count);
+static ssize_t (*libc_copy_file_range)(int in_fd, off_t *in_offset,
+                                       int out_fd, off_t *out_offset,
+                                       size_t length, unsigned int flags);
+static FILE *(*libc_fopen)(const char *path, const char *mode);
+static FILE *(*libc_fopen64)(const char *path, const char *mode);
+static int (*libc_fflush)(FILE *file);
+static int (*libc_fileno)(FILE *file);
+static int (*libc_setvbuf)(FILE *file, char *buf, int mode, size_t size);
+static void *(*libc_mmap)(void *addr, size_t length, int prot, int flags,
+                          int fd, off_t offset);
+static void *(*libc_mmap64)(void *addr, size_t length, int prot, int flags,
+                            int fd, off64_t offset);
+static int (*libc_msync)(void *addr, size_t length, int flags);
+static int (*libc_munmap)(void *addr, size_t length);
+
+#include "bypass.c"
+#include "dedup.c"
+#include "cookie.c"
+#include "mapping.c"
+#include "policy.c"
+#include "ring.c"
+#include "trace.c"
 
 #define RESOLVE_SYMBOL(name)                                                   \
     libc_##name = dlsym(RTLD_NEXT, #name);                                     \
@@ -36,19 +64,45 @@ static int (*libc_pread)(int fd, void *buf, size_t count, off_t offset);
     };
 
 void __attribute__((constructor)) libwritededuper_init(void) {
-    hashtable_init();
-
-    working_fds = hashmap_new(sizeof(struct WorkingFd), 0, 0, 0,
-                              working_fd_hash, working_fd_compare, NULL, NULL);
-
     RESOLVE_SYMBOL(write);
     RESOLVE_SYMBOL(pwrite);
     RESOLVE_SYMBOL(read);
     RESOLVE_SYMBOL(pread);
+    RESOLVE_SYMBOL(sendfile);
+    RESOLVE_SYMBOL(copy_file_range);
+    RESOLVE_SYMBOL(fopen);
+    RESOLVE_SYMBOL(fopen64);
+    RESOLVE_SYMBOL(fflush);
+    RESOLVE_SYMBOL(fileno);
+    RESOLVE_SYMBOL(setvbuf);
+    RESOLVE_SYMBOL(mmap);
+    RESOLVE_SYMBOL(mmap64);
+    RESOLVE_SYMBOL(msync);
+    RESOLVE_SYMBOL(munmap);
+
+    if (!trace_init(BLOCK_SIZE) && !ring_attach())
+        hashtable_init();
+    hash_pool_init();
+    policy_init();
+    bypass_init();
+    cookie_init();
+    mapping_init();
+    uring_init();
+
+    working_fds = hashmap_new(sizeof(struct WorkingFd), 0, 0, 0,
+                              working_fd_hash, working_fd_compare, NULL, NULL);
+    streams = hashmap_new(sizeof(struct Stream), 0, 0, 0, stream_hash,
+                          stream_compare, stream_free, NULL);
 
     libwritededuper_ready = 1;
 }
 
+// Whether fingerprints have anywhere to go: the trace, the daemon or the
+// index.
+int handle_indexing(void) {
+    return trace_fd >= 0 || ring_current() || hashtable_available();
+}
+
 ssize_t handle_fallback_write(int type, int fd, const void *buf, size_t count,
                               off_t offset) {
     if (type)
@@ -56,14 +110,48 @@ ssize_t handle_fallback_write(int type, int fd, const void *buf, size_t count,
     return (*libc_write)(fd, buf, count);
 }
 
+ssize_t handle_dedup(struct Dedup *dedup) {
+    struct Entry *entries = malloc(
+        (dedup->blocks + dedup->blocks / EXTENT_BLOCKS) * sizeof(struct Entry));
+    if (!entries) {
+        dedup_clone(dedup);
+        return dedup_write(dedup);
+    }
+
+    char in_path[PATH_MAX];
+    off_t in_offset;
+    if (stream_prediction(dedup->fd, dedup->offset, in_path, &in_offset))
+        dedup_predict(dedup, in_path, in_offset);
+    size_t entry_count = dedup_lookup(dedup, entries);
+
+    dedup_clone(dedup);
+    ssize_t total_written = dedup_write(dedup);
+    if (dedup->blocks && dedup->sources[dedup->blocks - 1].path)
+        stream_predict(dedup->fd, dedup->sources[dedup->blocks - 1].path,
+                       dedup->sources[dedup->blocks - 1].offset + BLOCK_SIZE,
+                       dedup->offset + dedup->blocks * BLOCK_SIZE);
+
+    hashtable_free_batch(entries, entry_count);
+    dedup_record(dedup, entries);
+
+    free(entries);
+    return total_written;
+}
+
 ssize_t handle_write(int type, int fd, const unsigned char *buf, size_t count,
                      off_t offset) {
     if (count < BLOCK_SIZE)
         return handle_fallback_write(type, fd, buf, count, offset);
 
     if (!type)
-        if ((offset = lseek(fd, 0, SEEK_CUR)) < 0 || offset % BLOCK_SIZE != 0)
+        if ((offset = lseek(fd, 0, SEEK_CUR)) < 0)
             return handle_fallback_write(type, fd, buf, count, offset);
+    if (offset % BLOCK_SIZE != 0 ||
+        (fcntl(fd, F_GETFL) & O_APPEND) == O_APPEND)
+        return handle_fallback_write(type, fd, buf, count, offset);
+    struct stat st;
+    if (!handle_indexing() || fstat(fd, &st) < 0)
+        return handle_fallback_write(type, fd, buf, count, offset);
 
     char path[PATH_MAX] = {0};
     char fd_link[PATH_MAX] = {0};
@@ -76,70 +164,97 @@ ssize_t handle_write(int type, int fd, const unsigned char *buf, size_t count,
         return handle_fallback_write(type, fd, buf, count, offset);
     };
 
-    ssize_t written, total_written = 0;
-    unsigned char block_buf[BLOCK_SIZE];
-
-    for (ssize_t block_offset = 0; (block_offset + BLOCK_SIZE) <= count;
-         block_offset += BLOCK_SIZE) {
-        memcpy(block_buf, &buf[block_offset], BLOCK_SIZE);
-        uint32_t hash = calculate_crc32c(0, block_buf, BLOCK_SIZE);
-
-        redisReply *reply = redisCommand(c, "GET %u", hash);
-        if (reply->type != REDIS_REPLY_STRING) {
-        fallback_write:
-            if ((written = handle_fallback_write(type, fd, block_buf,
-                                                 BLOCK_SIZE, offset)) < 0) {
-                fprintf(stderr,
-                        "libwritededuper: couldn't write to file descriptor "
-                        "%d: %m\n",
-                        fd);
-
-                freeReplyObject(reply);
-                return -1;
-            };
-            hashtable_set(hash, path, offset);
-            offset += BLOCK_SIZE;
-        } else {
-            if ((fcntl(fd, F_GETFL) & O_APPEND) == O_APPEND)
-                goto fallback_write;
-
-            char path[PATH_MAX];
-            unsigned long copied = strlcpy(path, reply->str, PATH_MAX - 1);
-            off_t in_offset = strtoul(&reply->str[copied + 1], NULL, 10);
-
-            int in_fd;
-            if ((in_fd = get_working_fd(path)) < 0)
-                goto fallback_write;
-
-            unsigned char in_buf[BLOCK_SIZE];
-            if ((*libc_pread)(in_fd, in_buf, BLOCK_SIZE, in_offset) <
-                BLOCK_SIZE)
-                goto fallback_write;
-            if (memcmp(block_buf, in_buf, BLOCK_SIZE) != 0)
-                goto fallback_write;
-
-            if ((written = copy_file_range(in_fd, &in_offset, fd, &offset,
-                                           BLOCK_SIZE, 0)) < 0) {
-                goto fallback_write;
-            }
-            if (!lseek(fd, written, SEEK_CUR)) {
-                fprintf(stderr,
-                        "libwritededuper: couldn't lseek %ld bytes on file "
-                        "descriptor %d: %m\n",
-                        written, fd);
-
-                freeReplyObject(reply);
-                return -1;
-            };
-        }
+    if (!policy_check(fd, &st, path, offset + count))
+        return handle_fallback_write(type, fd, buf, count, offset);
+    int bypass;
+    if ((bypass = bypass_check(fd, path)) == BYPASS_SKIP)
+        return handle_fallback_write(type, fd, buf, count, offset);
 
-        freeReplyObject(reply);
-        total_written += written;
+    // a probe only looks up up to the end of the first aligned extent, the
+    // rest is written as is
+    size_t rest = 0;
+    off_t extent_end =
+        (offset + EXTENT_SIZE - 1) / EXTENT_SIZE * EXTENT_SIZE + EXTENT_SIZE;
+    if (bypass == BYPASS_PROBE && count > (size_t)(extent_end - offset)) {
+        rest = count - (extent_end - offset);
+        count = extent_end - offset;
+    }
+
+    struct Dedup dedup = {
+        .fd = fd,
+        .dev = dedup_filesystem(fd, st.st_dev),
+        .path = path,
+        .offset = offset,
+        .buf = buf,
+        .blocks = count / BLOCK_SIZE,
     };
-
+    dedup.hashes = malloc(dedup.blocks * sizeof(uint32_t));
+    dedup.sources = calloc(dedup.blocks, sizeof(struct Source));
+    if (!dedup.hashes || !dedup.sources) {
+        free(dedup.hashes);
+        free(dedup.sources);
+        return handle_fallback_write(type, fd, buf, count, offset);
+    }
+
+    hash_blocks(buf, BLOCK_SIZE, dedup.hashes, dedup.blocks);
+
+    ssize_t total_written;
+    if (trace_fd >= 0) {
+        trace_record(TRACE_WRITE, fd, offset, dedup.hashes, dedup.blocks);
+        total_written = handle_fallback_write(type, fd, buf, count, offset);
+    } else if ((total_written = ring_dedup(&dedup)) == RING_UNAVAILABLE)
+        total_written = handle_dedup(&dedup);
+
+    size_t blocks = total_written > 0 ? total_written / BLOCK_SIZE : 0;
+    size_t hits = 0;
+    for (size_t i = 0; i < blocks; i++)
+        if (dedup.sources[i].path)
+            hits++;
+    if (trace_fd < 0)
+        bypass_update(fd, path, blocks, hits);
+
+    ssize_t rest_written;
+    if (rest && total_written == (ssize_t)count &&
+        (rest_written = handle_fallback_write(1, fd, &buf[count], rest,
+                                              offset + count)) > 0)
+        total_written += rest_written;
+    if (total_written > 0 && !type &&
+        lseek(fd, offset + total_written, SEEK_SET) < 0)
+        fprintf(stderr,
+                "libwritededuper: couldn't lseek to %ld on file descriptor "
+                "%d: %m\n",
+                offset + total_written, fd);
+
+    free(dedup.hashes);
+    free(dedup.sources);
     return total_written;
 }
 
+// Fingerprint and index the blocks of `dedup->buf`, which are already stored
+// at `dedup->offset` in `dedup->path`.
+void handle_record(struct Dedup *dedup) {
+    dedup->hashes = malloc(dedup->blocks * sizeof(uint32_t));
+    dedup->sources = calloc(dedup->blocks, sizeof(struct Source));
+    struct Entry *entries = malloc(
+        (dedup->blocks + dedup->blocks / EXTENT_BLOCKS) * sizeof(struct Entry));
+    if (dedup->hashes && dedup->sources && entries) {
+        hash_blocks(dedup->buf, BLOCK_SIZE, dedup->hashes, dedup->blocks);
+        if (trace_fd >= 0)
+            trace_record(TRACE_READ, dedup->fd, dedup->offset, dedup->hashes,
+                         dedup->blocks);
+        else {
+            // what the daemon didn't take is recorded here
+            struct Dedup rest = dedup_rest(dedup, ring_record(dedup));
+            if (rest.blocks)
+                dedup_record(&rest, entries);
+        }
+    }
+
+    free(dedup->hashes);
+    free(dedup->sources);
+    free(entries);
+}
+
 ssize_t handle_fallback_read(int type, int fd, void *buf, size_t count,
                              off_t offset) {
     if (type)
@@ -153,8 +268,11 @@ ssize_t handle_read(int type, int fd, unsigned char *buf, size_t count,
         return handle_fallback_read(type, fd, buf, count, offset);
 
     if (!type)
-        if ((offset = lseek(fd, 0, SEEK_CUR)) < 0 || offset % BLOCK_SIZE != 0)
+        if ((offset = lseek(fd, 0, SEEK_CUR)) < 0)
             return handle_fallback_read(type, fd, buf, count, offset);
+    struct stat st;
+    if (offset % BLOCK_SIZE != 0 || !handle_indexing() || fstat(fd, &st) < 0)
+        return handle_fallback_read(type, fd, buf, count, offset);
 
     char path[PATH_MAX] = {0};
     char fd_link[PATH_MAX] = {0};
@@ -167,22 +285,509 @@ ssize_t handle_read(int type, int fd, unsigned char *buf, size_t count,
         return handle_fallback_read(type, fd, buf, count, offset);
     };
 
+    if (!policy_check(fd, &st, path, 0))
+        return handle_fallback_read(type, fd, buf, count, offset);
+
     ssize_t s_count;
     if ((s_count = handle_fallback_read(type, fd, buf, count, offset)) < 0)
         return s_count;
 
-    unsigned char block_buf[BLOCK_SIZE];
-    for (ssize_t block_offset = 0; (block_offset + BLOCK_SIZE) <= s_count;
-         block_offset += BLOCK_SIZE) {
-        memcpy(block_buf, &buf[block_offset], BLOCK_SIZE);
-        uint32_t hash = calculate_crc32c(0, block_buf, BLOCK_SIZE);
-        hashtable_set(hash, path, offset);
-        offset += BLOCK_SIZE;
+    struct Dedup dedup = {
+        .fd = fd,
+        .dev = dedup_filesystem(fd, st.st_dev),
+        .path = path,
+        .offset = offset,
+        .buf = buf,
+        .blocks = s_count / BLOCK_SIZE,
     };
+    handle_record(&dedup);
 
     return s_count;
 }
 
+ssize_t handle_fallback_copy(int type, int out_fd, int in_fd, off_t *in_offset,
+                             off_t *out_offset, size_t count) {
+    if (type)
+        return (*libc_copy_file_range)(in_fd, in_offset, out_fd, out_offset,
+                                       count, 0);
+    return (*libc_sendfile)(out_fd, in_fd, in_offset, count);
+}
+
+// Clone the whole blocks of a file to file copy with `FICLONERANGE`, falling
+// back to `copy_file_range` where the filesystems can't share them, and index
+// them under the destination like a write would. `sendfile` (type 0) always
+// writes at the destination's position.
+ssize_t handle_copy(int type, int out_fd, int in_fd, off_t *in_offset,
+                    off_t *out_offset, size_t count) {
+    if (count < BLOCK_SIZE)
+        return handle_fallback_copy(type, out_fd, in_fd, in_offset, out_offset,
+                                    count);
+
+    struct stat in_stat, out_stat;
+    if (fstat(in_fd, &in_stat) < 0 || fstat(out_fd, &out_stat) < 0 ||
+        !S_ISREG(in_stat.st_mode) || !S_ISREG(out_stat.st_mode) ||
+        (fcntl(out_fd, F_GETFL) & O_APPEND) == O_APPEND)
+        return handle_fallback_copy(type, out_fd, in_fd, in_offset, out_offset,
+                                    count);
+
+    off_t in_start = in_offset ? *in_offset : lseek(in_fd, 0, SEEK_CUR);
+    off_t out_start = out_offset ? *out_offset : lseek(out_fd, 0, SEEK_CUR);
+    if (in_start < 0 || out_start < 0 || in_start % BLOCK_SIZE != 0 ||
+        out_start % BLOCK_SIZE != 0 || in_start >= in_stat.st_size)
+        return handle_fallback_copy(type, out_fd, in_fd, in_offset, out_offset,
+                                    count);
+
+    size_t length = count;
+    if (length > (size_t)(in_stat.st_size - in_start))
+        length = in_stat.st_size - in_start;
+    length -= length % BLOCK_SIZE;
+
+    char path[PATH_MAX] = {0};
+    char fd_link[PATH_MAX] = {0};
+    sprintf(fd_link, "/proc/self/fd/%d", out_fd);
+    if (!length || readlink(fd_link, path, PATH_MAX - 1) <= 0 ||
+        !policy_check(out_fd, &out_stat, path, out_start + count))
+        return handle_fallback_copy(type, out_fd, in_fd, in_offset, out_offset,
+                                    count);
+
+    off_t in_end = in_start, out_end = out_start;
+    size_t copied = 0;
+    ssize_t result;
+    struct file_clone_range range = {
+        .src_fd = in_fd,
+        .src_offset = in_start,
+        .src_length = length,
+        .dest_offset = out_start,
+    };
+    if (ioctl(out_fd, FICLONERANGE, &range) == 0) {
+        copied = length;
+        in_end += length;
+        out_end += length;
+    } else if (errno != EOPNOTSUPP && errno != EXDEV && errno != EINVAL) {
+        return -1;
+    }
+
+    // on another filesystem, one that can't clone, or with blocks smaller
+    // than those of the filesystem
+    while (copied < length &&
+           (result = (*libc_copy_file_range)(in_fd, &in_end, out_fd, &out_end,
+                                             length - copied, 0)) > 0)
+        copied += result;
+    if (!copied)
+        return handle_fallback_copy(type, out_fd, in_fd, in_offset, out_offset,
+                                    count);
+
+    // indexed a bounded chunk at a time, read back rather than mapped as the
+    // source may be truncated meanwhile
+    unsigned char *buf;
+    if (copied >= BLOCK_SIZE && handle_indexing() &&
+        (buf = malloc(MAPPING_CHUNK_BLOCKS * BLOCK_SIZE))) {
+        dev_t dev = dedup_filesystem(out_fd, out_stat.st_dev);
+        size_t blocks = copied / BLOCK_SIZE;
+        for (size_t first = 0; first < blocks;
+             first += MAPPING_CHUNK_BLOCKS) {
+            size_t chunk = blocks - first;
+            if (chunk > MAPPING_CHUNK_BLOCKS)
+                chunk = MAPPING_CHUNK_BLOCKS;
+            ssize_t filled = (*libc_pread)(in_fd, buf, chunk * BLOCK_SIZE,
+                                           in_start + first * BLOCK_SIZE);
+            if (filled < BLOCK_SIZE)
+                break;
+
+            struct Dedup dedup = {
+                .fd = out_fd,
+                .dev = dev,
+                .path = path,
+                .offset = out_start + first * BLOCK_SIZE,
+                .buf = buf,
+                .blocks = filled / BLOCK_SIZE,
+            };
+            handle_record(&dedup);
+            if ((size_t)filled < chunk * BLOCK_SIZE)
+                break;
+        }
+        free(buf);
+    }
+
+    if (in_offset)
+        *in_offset = in_end;
+    else
+        lseek(in_fd, in_end, SEEK_SET);
+    if (out_offset)
+        *out_offset = out_end;
+    else
+        lseek(out_fd, out_end, SEEK_SET);
+
+    // the partial block at the end is copied the way it was asked for
+    if (copied == length && copied < count &&
+        (result = handle_fallback_copy(type, out_fd, in_fd, in_offset,
+                                       out_offset, count - copied)) > 0)
+        copied += result;
+    return copied;
+}
+
+// Share the blocks of `dedup->buf`, already stored at `dedup->offset` and
+// fingerprinted, with copies found in the index, and index the rest. The
+// daemon only indexes them, as it has nothing to share them with.
+void handle_remap(struct Dedup *dedup) {
+    if (trace_fd >= 0) {
+        trace_record(TRACE_WRITE, dedup->fd, dedup->offset, dedup->hashes,
+                     dedup->blocks);
+        return;
+    }
+    // what the daemon didn't take is shared here
+    struct Dedup rest = dedup_rest(dedup, ring_record(dedup));
+    if (!rest.blocks)
+        return;
+
+    rest.sources = calloc(rest.blocks, sizeof(struct Source));
+    struct Entry *entries = malloc(
+        (rest.blocks + rest.blocks / EXTENT_BLOCKS) * sizeof(struct Entry));
+    if (rest.sources && entries) {
+        size_t entry_count = dedup_lookup(&rest, entries);
+        dedup_clone(&rest);
+        hashtable_free_batch(entries, entry_count);
+        dedup_record(&rest, entries);
+    }
+
+    free(rest.sources);
+    free(entries);
+}
+
+// Look up the blocks of `mapping` from `first` to `last` that changed since
+// they were last looked up. Only those whose pages were written to are read
+// back, from the file rather than the mapping, which the program may move,
+// protect or unmap at any time, a chunk of whole extents at a time.
+void handle_mapped(struct Mapping *mapping, size_t first, size_t last) {
+    unsigned char *buf = malloc(MAPPING_CHUNK_BLOCKS * BLOCK_SIZE);
+    unsigned char *changed = malloc(MAPPING_CHUNK_BLOCKS);
+    if (!buf || !changed) {
+        free(buf);
+        free(changed);
+        return;
+    }
+
+    for (size_t chunk = first, end; chunk < last; chunk = end) {
+        end = chunk + MAPPING_CHUNK_BLOCKS -
+              (mapping->offset / BLOCK_SIZE + chunk) % MAPPING_CHUNK_BLOCKS;
+        if (end > last)
+            end = last;
+        memset(changed, 0, end - chunk);
+        for (size_t i = chunk; i < end; i++) {
+            if (!mapping_take_dirty(mapping, i))
+                continue;
+
+            size_t j = i + 1;
+            while (j < end && mapping_take_dirty(mapping, j))
+                j++;
+            mapping_read(mapping, i, j - i, &buf[(i - chunk) * BLOCK_SIZE],
+                         &changed[i - chunk]);
+            i = j;
+        }
+
+        for (size_t i = chunk; i < end; i++) {
+            if (!changed[i - chunk])
+                continue;
+            uint32_t hash = calculate_crc32c(0, &buf[(i - chunk) * BLOCK_SIZE],
+                                             BLOCK_SIZE);
+            changed[i - chunk] =
+                !mapping->known[i] || mapping->hashes[i] != hash;
+            mapping->hashes[i] = hash;
+            mapping->known[i] = 1;
+        }
+
+        for (size_t i = chunk; i < end; i++) {
+            if (!changed[i - chunk])
+                continue;
+
+            size_t j = i + 1;
+            while (j < end && changed[j - chunk])
+                j++;
+            struct Dedup dedup = {
+                .fd = mapping->fd,
+                .dev = mapping->dev,
+                .path = mapping->path,
+                .offset = mapping->offset + i * BLOCK_SIZE,
+                .buf = &buf[(i - chunk) * BLOCK_SIZE],
+                .blocks = j - i,
+                .hashes = &mapping->hashes[i],
+                .share = 1,
+            };
+            handle_remap(&dedup);
+            i = j;
+        }
+    }
+
+    free(buf);
+    free(changed);
+}
+
+// Look up what was written through the tracked mappings overlapping `length`
+// bytes at `addr`. Mappings that are about to be `unmap`ped are looked up as
+// a whole and forgotten, even if only part of them is.
+void handle_unmap(void *addr, size_t length, int unmap) {
+    struct Mapping **taken;
+    size_t count = mapping_take(addr, length, unmap, &taken);
+    mapping_collect_dirty(taken, count);
+    for (size_t i = 0; i < count; i++) {
+        struct Mapping *mapping = taken[i];
+        size_t first = 0, last = mapping->blocks;
+        uintptr_t start = (uintptr_t)mapping->addr;
+        uintptr_t end = (uintptr_t)addr + length;
+        if (!unmap && (uintptr_t)addr > start)
+            first = ((uintptr_t)addr - start) / BLOCK_SIZE;
+        if (!unmap && end > (uintptr_t)addr && end < start + last * BLOCK_SIZE)
+            last = (end - start + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        handle_mapped(mapping, first, last);
+    }
+    mapping_release(taken, count);
+}
+
+void *handle_fallback_mmap(int type, void *addr, size_t length, int prot,
+                           int flags, int fd, off_t offset) {
+    if (type)
+        return (*libc_mmap64)(addr, length, prot, flags, fd, offset);
+    return (*libc_mmap)(addr, length, prot, flags, fd, offset);
+}
+
+// Map a file, tracking shared writable mappings of whole blocks of regular
+// files, whose writes never go through `write`. `mmap64` is type 1.
+void *handle_mmap(int type, void *addr, size_t length, int prot, int flags,
+                  int fd, off_t offset) {
+    // whatever was mapped there before goes away
+    if (libwritededuper_ready && (flags & MAP_FIXED))
+        handle_unmap(addr, length, 1);
+
+    void *map =
+        handle_fallback_mmap(type, addr, length, prot, flags, fd, offset);
+    struct stat st;
+    if (map == MAP_FAILED || !libwritededuper_ready || !mapping_enabled ||
+        fd < 0 || !(prot & PROT_WRITE) || !(flags & MAP_SHARED) ||
+        (flags & MAP_ANONYMOUS) || offset % BLOCK_SIZE != 0 ||
+        !handle_indexing() || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+        offset >= st.st_size)
+        return map;
+
+    size_t blocks = st.st_size - offset;
+    if (blocks > length)
+        blocks = length;
+    blocks /= BLOCK_SIZE;
+
+    char path[PATH_MAX] = {0};
+    char fd_link[PATH_MAX] = {0};
+    sprintf(fd_link, "/proc/self/fd/%d", fd);
+    if (blocks && readlink(fd_link, path, PATH_MAX - 1) > 0 &&
+        policy_check(fd, &st, path, 0))
+        mapping_add(map, blocks, fd, &st, path, offset);
+    return map;
+}
+
+// Write `length` bytes of `buf` at the position of `cookie`. Returns how many
+// were written.
+size_t handle_stdio_put(struct Cookie *cookie, const unsigned char *buf,
+                        size_t length) {
+    size_t done = 0;
+    ssize_t written;
+    while (done < length &&
+           (written = handle_write(1, cookie->fd, &buf[done], length - done,
+                                   cookie->offset)) > 0) {
+        done += written;
+        cookie->offset += written;
+    }
+    return done;
+}
+
+// Write out the buffer of `cookie`, keeping whatever couldn't be written.
+int handle_stdio_flush(struct Cookie *cookie) {
+    size_t written = handle_stdio_put(cookie, cookie->data, cookie->length);
+    memmove(cookie->data, &cookie->data[written], cookie->length - written);
+    cookie->length -= written;
+    return !cookie->length;
+}
+
+ssize_t handle_stdio_write(void *c, const char *buf, size_t size) {
+    struct Cookie *cookie = c;
+    pthread_mutex_lock(&cookie->lock);
+
+    size_t done = 0;
+    int ok = 1;
+    while (ok && done < size) {
+        size_t left = size - done;
+        if (!cookie->length && cookie->offset % BLOCK_SIZE == 0 &&
+            left >= cookie_buffer_size) {
+            // whole buffers' worth of blocks don't need copying
+            size_t length = left - left % BLOCK_SIZE;
+            size_t written = handle_stdio_put(
+                cookie, (const unsigned char *)&buf[done], length);
+            done += written;
+            ok = written == length;
+            continue;
+        }
+
+        size_t length = cookie_space(cookie);
+        if (length > left)
+            length = left;
+        memcpy(&cookie->data[cookie->length], &buf[done], length);
+        cookie->length += length;
+        done += length;
+        if (!cookie_space(cookie))
+            ok = handle_stdio_flush(cookie);
+    }
+    if (ok && (cookie->sync || cookie_exiting))
+        handle_stdio_flush(cookie);
+
+    pthread_mutex_unlock(&cookie->lock);
+    return done ? (ssize_t)done : -1;
+}
+
+int handle_stdio_seek(void *c, off64_t *position, int whence) {
+    struct Cookie *cookie = c;
+    pthread_mutex_lock(&cookie->lock);
+
+    off_t offset = -1;
+    if (whence == SEEK_SET)
+        offset = *position;
+    else if (whence == SEEK_CUR)
+        offset = cookie->offset + cookie->length + *position;
+    // ftell asks where the stream is, which shouldn't cut the buffer short
+    if (offset != (off_t)(cookie->offset + cookie->length)) {
+        if (!handle_stdio_flush(cookie))
+            offset = -1;
+        else if (whence == SEEK_END)
+            offset = lseek(cookie->fd, *position, SEEK_END);
+    }
+    if (offset >= 0) {
+        cookie->offset = offset - cookie->length;
+        *position = offset;
+    } else if (whence != SEEK_END)
+        errno = EINVAL;
+
+    pthread_mutex_unlock(&cookie->lock);
+    return offset < 0 ? -1 : 0;
+}
+
+int handle_stdio_close(void *c) {
+    struct Cookie *cookie = c;
+    pthread_mutex_lock(&cookie_lock);
+    hashmap_delete(cookie_files, &(struct CookieFile){.file = cookie->file});
+    pthread_mutex_unlock(&cookie_lock);
+
+    int ok = handle_stdio_flush(cookie);
+    ok &= close(cookie->fd) == 0;
+    pthread_mutex_destroy(&cookie->lock);
+    free(cookie->data);
+    free(cookie);
+    return ok ? 0 : EOF;
+}
+
+static cookie_io_functions_t handle_stdio_functions = {
+    .write = handle_stdio_write,
+    .seek = handle_stdio_seek,
+    .close = handle_stdio_close,
+};
+
+FILE *handle_fallback_fopen(int type, const char *path, const char *mode) {
+    if (type)
+        return (*libc_fopen64)(path, mode);
+    return (*libc_fopen)(path, mode);
+}
+
+// Open a stdio stream that only writes a regular file through a buffer of
+// whole blocks, which glibc's own buffer wouldn't keep aligned to the file,
+// and whose writes wouldn't go through `write`. Files whose writes wouldn't
+// be deduplicated anyway get a plain stream. `fopen64` is type 1.
+FILE *handle_fopen(int type, const char *path, const char *mode) {
+    int flags;
+    struct stat st;
+    if (!cookie_buffer_size || (flags = cookie_flags(mode)) < 0 ||
+        !handle_indexing() || (stat(path, &st) == 0 && !S_ISREG(st.st_mode)))
+        return handle_fallback_fopen(type, path, mode);
+
+    int fd;
+    if ((fd = open(path, flags, 0666)) < 0)
+        return NULL;
+
+    // the file may still grow past the minimum size
+    char fd_path[PATH_MAX] = {0};
+    char fd_link[PATH_MAX] = {0};
+    sprintf(fd_link, "/proc/self/fd/%d", fd);
+    if (fstat(fd, &st) < 0 || readlink(fd_link, fd_path, PATH_MAX - 1) <= 0 ||
+        !policy_check(fd, &st, fd_path, policy_min_size))
+        return fdopen(fd, mode);
+
+    struct Cookie *cookie = calloc(1, sizeof(struct Cookie));
+    FILE *file = NULL;
+    if (cookie &&
+        (cookie->data = aligned_alloc(BLOCK_SIZE, cookie_buffer_size)))
+        file = fopencookie(cookie, "w", handle_stdio_functions);
+    if (!file) {
+        if (cookie)
+            free(cookie->data);
+        free(cookie);
+        return fdopen(fd, "w");
+    }
+
+    cookie->file = file;
+    cookie->fd = fd;
+    pthread_mutex_init(&cookie->lock, NULL);
+    pthread_mutex_lock(&cookie_lock);
+    hashmap_set(cookie_files,
+                &(struct CookieFile){.file = file, .cookie = cookie});
+    pthread_mutex_unlock(&cookie_lock);
+    return file;
+}
+
+// Write out what the wrapper of `file` holds back, leaving the descriptor at
+// the position of the stream. Returns the descriptor, or -1 if `file` isn't
+// wrapped.
+int handle_stdio_sync(FILE *file, int *ok) {
+    int fd = -1;
+    pthread_mutex_lock(&cookie_lock);
+    const struct CookieFile *found =
+        hashmap_get(cookie_files, &(struct CookieFile){.file = file});
+    if (found) {
+        struct Cookie *cookie = found->cookie;
+        pthread_mutex_lock(&cookie->lock);
+        *ok = handle_stdio_flush(cookie);
+        lseek(cookie->fd, cookie->offset, SEEK_SET);
+        fd = cookie->fd;
+        pthread_mutex_unlock(&cookie->lock);
+    }
+    pthread_mutex_unlock(&cookie_lock);
+    return fd;
+}
+
+int handle_stdio_sync_all(void) {
+    int ok = 1;
+    pthread_mutex_lock(&cookie_lock);
+    size_t iter = 0;
+    void *item;
+    while (hashmap_iter(cookie_files, &iter, &item)) {
+        struct Cookie *cookie = ((struct CookieFile *)item)->cookie;
+        pthread_mutex_lock(&cookie->lock);
+        ok &= handle_stdio_flush(cookie);
+        pthread_mutex_unlock(&cookie->lock);
+    }
+    pthread_mutex_unlock(&cookie_lock);
+    return ok;
+}
+
+// Write out every wrapped stream at exit. This runs before glibc flushes its
+// own buffers, which would otherwise leave the tails held back here unwritten,
+// and anything written after is let straight through. Mappings that are still
+// around are looked up as if they were synced, and the local cache is saved
+// last, with whatever all of that added.
+void __attribute__((destructor)) libwritededuper_fini(void) {
+    if (!libwritededuper_ready)
+        return;
+
+    cookie_exiting = 1;
+    (*libc_fflush)(NULL);
+    handle_stdio_sync_all();
+    handle_unmap(NULL, SIZE_MAX, 0);
+    hashtable_save(0);
+}
+
 ssize_t write(int fd, const void *buf, size_t count) {
     if (!libwritededuper_ready)
         libwritededuper_init();
@@ -210,3 +815,129 @@ ssize_t pread(int fd, void *buf, size_t count, off_t offset) {
 
     return handle_read(1, fd, buf, count, offset);
 }
+
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count) {
+    if (!libwritededuper_ready)
+        libwritededuper_init();
+
+    return handle_copy(0, out_fd, in_fd, offset, NULL, count);
+}
+
+ssize_t copy_file_range(int in_fd, off_t *in_offset, int out_fd,
+                        off_t *out_offset, size_t length, unsigned int flags) {
+    if (!libwritededuper_ready)
+        libwritededuper_init();
+
+    if (flags)
+        return (*libc_copy_file_range)(in_fd, in_offset, out_fd, out_offset,
+                                       length, flags);
+    return handle_copy(1, out_fd, in_fd, in_offset, out_offset, length);
+}
+
+FILE *fopen(const char *path, const char *mode) {
+    if (!libwritededuper_ready)
+        libwritededuper_init();
+
+    return handle_fopen(0, path, mode);
+}
+
+FILE *fopen64(const char *path, const char *mode) {
+    if (!libwritededuper_ready)
+        libwritededuper_init();
+
+    return handle_fopen(1, path, mode);
+}
+
+int fflush(FILE *file) {
+    if (!libwritededuper_ready)
+        libwritededuper_init();
+
+    int result = (*libc_fflush)(file), ok = 1;
+    if (!file)
+        ok = handle_stdio_sync_all();
+    else
+        handle_stdio_sync(file, &ok);
+    return ok ? result : EOF;
+}
+
+// A wrapped stream has no descriptor of its own as far as glibc knows. The
+// one underneath is handed out with everything written, as it is most likely
+// about to be synced or inspected. Other streams are left as they are.
+int handle_fileno(FILE *file) {
+    int fd, ok;
+    if (cookie_wrapped(file) && (*libc_fflush)(file) == 0 &&
+        (fd = handle_stdio_sync(file, &ok)) >= 0)
+        return fd;
+    return (*libc_fileno)(file);
+}
+
+int fileno(FILE *file) {
+    if (!libwritededuper_ready)
+        libwritededuper_init();
+
+    return handle_fileno(file);
+}
+
+int fileno_unlocked(FILE *file) {
+    if (!libwritededuper_ready)
+        libwritededuper_init();
+
+    return handle_fileno(file);
+}
+
+int setvbuf(FILE *file, char *buf, int mode, size_t size) {
+    if (!libwritededuper_ready)
+        libwritededuper_init();
+
+    int result;
+    if ((result = (*libc_setvbuf)(file, buf, mode, size)) != 0)
+        return result;
+
+    pthread_mutex_lock(&cookie_lock);
+    const struct CookieFile *found =
+        hashmap_get(cookie_files, &(struct CookieFile){.file = file});
+    if (found)
+        found->cookie->sync = mode != _IOFBF;
+    pthread_mutex_unlock(&cookie_lock);
+    return 0;
+}
+
+void *mmap(void *addr, size_t length, int prot, int flags, int fd,
+           off_t offset) {
+    // mappings made while starting up are let straight through
+    if (!libc_mmap)
+        libwritededuper_init();
+
+    return handle_mmap(0, addr, length, prot, flags, fd, offset);
+}
+
+void *mmap64(void *addr, size_t length, int prot, int flags, int fd,
+             off64_t offset) {
+    if (!libc_mmap64)
+        libwritededuper_init();
+
+    return handle_mmap(1, addr, length, prot, flags, fd, offset);
+}
+
+// Blocks are looked up once they are written back, so that sharing them
+// doesn't have to write them out first.
+int msync(void *addr, size_t length, int flags) {
+    if (!libc_msync)
+        libwritededuper_init();
+
+    // without soft-dirty bits whole mappings would be read back on every
+    // call, so they are left to `munmap` and exit
+    int result = (*libc_msync)(addr, length, flags);
+    if (result == 0 && libwritededuper_ready && mapping_soft_dirty)
+        handle_unmap(addr, length, 0);
+    return result;
+}
+
+int munmap(void *addr, size_t length) {
+    if (!libc_munmap)
+        libwritededuper_init();
+
+    if (libwritededuper_ready)
+        handle_unmap(addr, length, 1);
+    return (*libc_munmap)(addr, length);
+}
@@ -0,0 +1,325 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "hashmap/hashmap.h"
+
+// Blocks read back at once, a multiple of EXTENT_BLOCKS
+#define MAPPING_CHUNK_BLOCKS 256
+// Pages whose `/proc/self/pagemap` entries are read at once
+#define MAPPING_PAGEMAP_PAGES 512
+// Set in a `/proc/self/pagemap` entry for a page written to since the
+// soft-dirty bits were last cleared
+#define MAPPING_SOFT_DIRTY (1ULL << 55)
+
+// A shared writable mapping of a regular file, whose blocks are looked up
+// when it is synced or unmapped as they never go through `write`.
+struct Mapping {
+    unsigned char *addr;
+    // whole blocks of the file under the mapping when it was made
+    size_t blocks;
+    // a duplicate, as the mapping outlives the descriptor it was made with
+    int fd;
+    // filesystem, from `dedup_filesystem`
+    dev_t dev;
+    char *path;
+    off_t offset;
+    // of each block when it was last looked up, if it is `known`
+    uint32_t *hashes;
+    unsigned char *known;
+    // of each block whose pages were written to since it was last looked up
+    unsigned char *dirty;
+    // taken by a thread that doesn't hold `mapping_lock`
+    int busy;
+    // unmapped while taken, to be freed when handed back
+    int unmapped;
+};
+
+struct MappingAddress {
+    void *addr;
+    struct Mapping *mapping;
+};
+
+// Whether shared writable mappings are tracked at all
+int mapping_enabled = 1;
+// Whether the kernel tells which pages were written to, so that only their
+// blocks are looked up. Otherwise mappings are only looked up as a whole when
+// they are unmapped and at exit.
+int mapping_soft_dirty = 0;
+struct hashmap *mapping_addresses;
+// Mappings being tracked, checked without the lock by every `munmap`
+size_t mapping_count = 0;
+pthread_mutex_t mapping_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t mapping_address_hash(const void *item, uint64_t seed0,
+                              uint64_t seed1) {
+    const struct MappingAddress *address = item;
+    return hashmap_sip(&address->addr, sizeof(address->addr), seed0, seed1);
+}
+
+int mapping_address_compare(const void *a, const void *b, void *data) {
+    const struct MappingAddress *aa = a;
+    const struct MappingAddress *bb = b;
+    return aa->addr != bb->addr;
+}
+
+// Clear the soft-dirty bits of every page of the process.
+int mapping_clear_soft_dirty(void) {
+    int fd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    int cleared = (*libc_write)(fd, "4", 1) == 1;
+    close(fd);
+    return cleared;
+}
+
+// Whether a page written to after its soft-dirty bit was cleared has it set
+// again, which it never does on kernels built without them.
+int mapping_probe_soft_dirty(void) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    volatile unsigned char *page =
+        (*libc_mmap)(NULL, page_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (page == MAP_FAILED)
+        return 0;
+
+    uint64_t entry = 0;
+    int fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    page[0] = 1;
+    if (fd >= 0 && mapping_clear_soft_dirty()) {
+        page[0] = 2;
+        if ((*libc_pread)(fd, &entry, sizeof(entry),
+                          (uintptr_t)page / page_size * sizeof(entry)) !=
+            sizeof(entry))
+            entry = 0;
+    }
+    if (fd >= 0)
+        close(fd);
+    (*libc_munmap)((void *)page, page_size);
+    return (entry & MAPPING_SOFT_DIRTY) != 0;
+}
+
+void mapping_init(void) {
+    char *str_enabled;
+    if ((str_enabled = getenv("LIBWRITEDEDUPER_MMAP")))
+        mapping_enabled = atoi(str_enabled);
+
+    mapping_addresses = hashmap_new(sizeof(struct MappingAddress), 0, 0, 0,
+                                    mapping_address_hash,
+                                    mapping_address_compare, NULL, NULL);
+    if (mapping_enabled)
+        mapping_soft_dirty = mapping_probe_soft_dirty();
+}
+
+void mapping_free(struct Mapping *mapping) {
+    close(mapping->fd);
+    free(mapping->path);
+    free(mapping->hashes);
+    free(mapping->known);
+    free(mapping->dirty);
+    free(mapping);
+}
+
+// Start tracking `blocks` blocks mapped at `addr` from `offset` in `fd`.
+void mapping_add(unsigned char *addr, size_t blocks, int fd,
+                 const struct stat *st, const char *path, off_t offset) {
+    struct Mapping *mapping = calloc(1, sizeof(struct Mapping));
+    if (!mapping)
+        return;
+    *mapping = (struct Mapping){
+        .addr = addr,
+        .blocks = blocks,
+        .fd = fcntl(fd, F_DUPFD_CLOEXEC, 0),
+        .dev = dedup_filesystem(fd, st->st_dev),
+        .path = strdup(path),
+        .offset = offset,
+        .hashes = malloc(blocks * sizeof(uint32_t)),
+        .known = calloc(blocks, 1),
+        .dirty = malloc(blocks),
+    };
+    if (mapping->fd < 0 || !mapping->path || !mapping->hashes ||
+        !mapping->known || !mapping->dirty) {
+        mapping_free(mapping);
+        return;
+    }
+    memset(mapping->dirty, 1, blocks);
+
+    pthread_mutex_lock(&mapping_lock);
+    const struct MappingAddress *old = hashmap_set(
+        mapping_addresses,
+        &(struct MappingAddress){.addr = addr, .mapping = mapping});
+    // the address was reused after the mapping there was moved away
+    if (old && old->mapping->busy)
+        old->mapping->unmapped = 1;
+    else if (old)
+        mapping_free(old->mapping);
+    __atomic_store_n(&mapping_count, hashmap_count(mapping_addresses),
+                     __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&mapping_lock);
+}
+
+// Mark the blocks of `mapping` whose pages were written to since the
+// soft-dirty bits were last cleared, or all of them if that can't be told.
+void mapping_mark_dirty(struct Mapping *mapping, int pagemap,
+                        long page_size) {
+    uint64_t entries[MAPPING_PAGEMAP_PAGES];
+    size_t first_page = (uintptr_t)mapping->addr / page_size;
+    size_t pages = (mapping->blocks * BLOCK_SIZE + page_size - 1) / page_size;
+    for (size_t chunk = 0; chunk < pages; chunk += MAPPING_PAGEMAP_PAGES) {
+        size_t count = pages - chunk;
+        if (count > MAPPING_PAGEMAP_PAGES)
+            count = MAPPING_PAGEMAP_PAGES;
+        ssize_t result =
+            (*libc_pread)(pagemap, entries, count * sizeof(uint64_t),
+                          (first_page + chunk) * sizeof(uint64_t));
+        if (result != (ssize_t)(count * sizeof(uint64_t))) {
+            for (size_t i = 0; i < mapping->blocks; i++)
+                __atomic_store_n(&mapping->dirty[i], 1, __ATOMIC_RELAXED);
+            return;
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            if (!(entries[i] & MAPPING_SOFT_DIRTY))
+                continue;
+            size_t first = (chunk + i) * page_size / BLOCK_SIZE;
+            size_t last =
+                ((chunk + i + 1) * page_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            for (size_t j = first; j < last && j < mapping->blocks; j++)
+                __atomic_store_n(&mapping->dirty[j], 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Whether block `i` of `mapping` may have been written to since it was last
+// looked up, forgetting that it was.
+int mapping_take_dirty(struct Mapping *mapping, size_t i) {
+    if (!mapping_soft_dirty)
+        return 1;
+    return __atomic_exchange_n(&mapping->dirty[i], 0, __ATOMIC_RELAXED);
+}
+
+// Mark the blocks of the `count` mappings in `taken` and of every other
+// tracked one that were written to, then clear the soft-dirty bits to tell
+// the next writes apart. Those made in between are missed until their pages
+// are written to again.
+void mapping_collect_dirty(struct Mapping **taken, size_t count) {
+    if (!mapping_soft_dirty || !count)
+        return;
+
+    // without it every block is marked
+    long page_size = sysconf(_SC_PAGESIZE);
+    int pagemap = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+
+    pthread_mutex_lock(&mapping_lock);
+    for (size_t i = 0; i < count; i++)
+        if (taken[i]->unmapped)
+            mapping_mark_dirty(taken[i], pagemap, page_size);
+    size_t iter = 0;
+    void *item;
+    while (hashmap_iter(mapping_addresses, &iter, &item))
+        mapping_mark_dirty(((struct MappingAddress *)item)->mapping, pagemap,
+                           page_size);
+    mapping_clear_soft_dirty();
+    pthread_mutex_unlock(&mapping_lock);
+    if (pagemap >= 0)
+        close(pagemap);
+}
+
+// Take the tracked mappings overlapping `length` bytes at `addr` that no
+// other thread has taken, forgetting them if they are being `unmap`ped.
+// Returns how many were stored in `*taken`, which the caller frees.
+size_t mapping_take(void *addr, size_t length, int unmap,
+                    struct Mapping ***taken) {
+    uintptr_t start = (uintptr_t)addr, end = start + length;
+    if (end < start)
+        end = UINTPTR_MAX;
+
+    *taken = NULL;
+    if (!__atomic_load_n(&mapping_count, __ATOMIC_RELAXED))
+        return 0;
+
+    size_t count = 0, found = 0;
+    pthread_mutex_lock(&mapping_lock);
+    *taken = malloc(hashmap_count(mapping_addresses) *
+                    sizeof(struct Mapping *));
+    struct MappingAddress *forgotten =
+        malloc(hashmap_count(mapping_addresses) *
+               sizeof(struct MappingAddress));
+    size_t iter = 0;
+    void *item;
+    while (*taken && forgotten &&
+           hashmap_iter(mapping_addresses, &iter, &item)) {
+        struct Mapping *mapping = ((struct MappingAddress *)item)->mapping;
+        uintptr_t first = (uintptr_t)mapping->addr;
+        if (first >= end || first + mapping->blocks * BLOCK_SIZE <= start)
+            continue;
+
+        if (unmap) {
+            forgotten[found++] = *(struct MappingAddress *)item;
+            mapping->unmapped = 1;
+        }
+        if (!mapping->busy) {
+            mapping->busy = 1;
+            (*taken)[count++] = mapping;
+        }
+    }
+    for (size_t i = 0; i < found; i++)
+        hashmap_delete(mapping_addresses, &forgotten[i]);
+    __atomic_store_n(&mapping_count, hashmap_count(mapping_addresses),
+                     __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&mapping_lock);
+
+    free(forgotten);
+    return count;
+}
+
+// Read `blocks` blocks of `mapping` from `first` on into `buf`, setting
+// `cached[i]` for each one that was. Blocks that would have to come from disk
+// are left out, as they were written back long enough ago to be evicted, and
+// so are those past the end of a file that was truncated since.
+void mapping_read(struct Mapping *mapping, size_t first, size_t blocks,
+                  unsigned char *buf, unsigned char *cached) {
+    memset(cached, 0, blocks);
+    size_t length = blocks * BLOCK_SIZE, done = 0, marked = 0;
+    while (done < length) {
+        off_t offset = mapping->offset + first * BLOCK_SIZE + done;
+        struct iovec iov = {&buf[done], length - done};
+        ssize_t result = preadv2(mapping->fd, &iov, 1, offset, RWF_NOWAIT);
+        if (result < 0 && errno == EOPNOTSUPP)
+            result = (*libc_pread)(mapping->fd, &buf[done], length - done,
+                                   offset);
+        if (result < 0 && errno == EAGAIN) {
+            done += BLOCK_SIZE - done % BLOCK_SIZE;
+            marked = done / BLOCK_SIZE;
+            continue;
+        }
+        if (result <= 0)
+            break;
+
+        done += result;
+        for (; marked < done / BLOCK_SIZE; marked++)
+            cached[marked] = 1;
+    }
+}
+
+// Hand back mappings from `mapping_take`, freeing those unmapped since.
+void mapping_release(struct Mapping **taken, size_t count) {
+    if (count) {
+        pthread_mutex_lock(&mapping_lock);
+        for (size_t i = 0; i < count; i++) {
+            taken[i]->busy = 0;
+            if (taken[i]->unmapped)
+                mapping_free(taken[i]);
+        }
+        pthread_mutex_unlock(&mapping_lock);
+    }
+    free(taken);
+}
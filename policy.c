@@ -0,0 +1,150 @@
+#include <fnmatch.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/vfs.h>
+
+#include "hashmap/hashmap.h"
+
+#define POLICY_UNKNOWN 0
+#define POLICY_DEDUP 1
+#define POLICY_SKIP 2
+
+struct PolicyDevice {
+    dev_t dev;
+    int reflink;
+};
+
+// Filesystems that can share extents between files, by `statfs` magic
+static const unsigned long policy_reflink_filesystems[] = {
+    0x9123683e, // btrfs
+    0x58465342, // xfs
+    0x7461636f, // ocfs2
+    0xca451a4e, // bcachefs
+    0x2fc12fc1, // zfs
+    0x6969,     // nfs
+    0xfe534d42, // smb2
+};
+
+char **policy_include = NULL;
+char **policy_exclude = NULL;
+off_t policy_min_size = 0;
+int policy_reflink_only = 1;
+struct hashmap *policy_devices;
+pthread_mutex_t policy_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t policy_device_hash(const void *item, uint64_t seed0, uint64_t seed1) {
+    const struct PolicyDevice *device = item;
+    return hashmap_sip(&device->dev, sizeof(device->dev), seed0, seed1);
+}
+
+int policy_device_compare(const void *a, const void *b, void *data) {
+    const struct PolicyDevice *aa = a;
+    const struct PolicyDevice *bb = b;
+    return aa->dev != bb->dev;
+}
+
+// Split a colon separated list of patterns, like PATH.
+char **policy_parse_patterns(const char *name) {
+    char *str_patterns;
+    if (!(str_patterns = getenv(name)) || !*str_patterns)
+        return NULL;
+
+    size_t count = 2;
+    for (char *p = str_patterns; *p; p++)
+        if (*p == ':')
+            count++;
+
+    char **patterns = calloc(count, sizeof(char *));
+    char *copy = strdup(str_patterns), *saveptr, *pattern;
+    if (!patterns || !copy) {
+        free(patterns);
+        free(copy);
+        return NULL;
+    }
+
+    size_t i = 0;
+    for (pattern = strtok_r(copy, ":", &saveptr); pattern;
+         pattern = strtok_r(NULL, ":", &saveptr))
+        patterns[i++] = pattern;
+    return patterns;
+}
+
+void policy_init(void) {
+    policy_include = policy_parse_patterns("LIBWRITEDEDUPER_INCLUDE");
+    policy_exclude = policy_parse_patterns("LIBWRITEDEDUPER_EXCLUDE");
+
+    char *str_min_size;
+    if ((str_min_size = getenv("LIBWRITEDEDUPER_MIN_SIZE")))
+        policy_min_size = strtoll(str_min_size, NULL, 10);
+    char *str_reflink_only;
+    if ((str_reflink_only = getenv("LIBWRITEDEDUPER_REFLINK_ONLY")))
+        policy_reflink_only = atoi(str_reflink_only);
+
+    policy_devices = hashmap_new(sizeof(struct PolicyDevice), 0, 0, 0,
+                                 policy_device_hash, policy_device_compare,
+                                 NULL, NULL);
+}
+
+int policy_match(char **patterns, const char *path) {
+    for (; *patterns; patterns++)
+        if (fnmatch(*patterns, path, 0) == 0)
+            return 1;
+    return 0;
+}
+
+// Whether the filesystem `fd` is on can clone, checked once per device.
+int policy_reflink(int fd, dev_t dev) {
+    if (!policy_reflink_only)
+        return 1;
+
+    pthread_mutex_lock(&policy_lock);
+    const struct PolicyDevice *device =
+        hashmap_get(policy_devices, &(struct PolicyDevice){.dev = dev});
+    int reflink = device ? device->reflink : -1;
+    pthread_mutex_unlock(&policy_lock);
+    if (reflink >= 0)
+        return reflink;
+
+    struct statfs fs;
+    if (fstatfs(fd, &fs) < 0)
+        return 0;
+
+    reflink = 0;
+    for (size_t i = 0; i < sizeof(policy_reflink_filesystems) /
+                                sizeof(*policy_reflink_filesystems);
+         i++)
+        if ((unsigned long)fs.f_type == policy_reflink_filesystems[i])
+            reflink = 1;
+    pthread_mutex_lock(&policy_lock);
+    hashmap_set(policy_devices,
+                &(struct PolicyDevice){.dev = dev, .reflink = reflink});
+    pthread_mutex_unlock(&policy_lock);
+    return reflink;
+}
+
+// Whether I/O on `fd`, open on the file `st` at `path`, is deduplicated. The
+// paths and filesystem are only checked the first time the fd is seen, the
+// size of the file, or of what it will be once `end` is written, every time.
+int policy_check(int fd, const struct stat *st, const char *path, off_t end) {
+    if (end < st->st_size)
+        end = st->st_size;
+    if (end < policy_min_size)
+        return 0;
+
+    struct Stream stream;
+    if (get_stream(fd, &stream) && stream.dev == st->st_dev &&
+        stream.ino == st->st_ino && stream.policy != POLICY_UNKNOWN)
+        return stream.policy == POLICY_DEDUP;
+
+    int dedup = S_ISREG(st->st_mode) && policy_reflink(fd, st->st_dev) &&
+                (!policy_include || policy_match(policy_include, path)) &&
+                (!policy_exclude || !policy_match(policy_exclude, path));
+    stream_set_policy(fd, st->st_dev, st->st_ino,
+                      dedup ? POLICY_DEDUP : POLICY_SKIP);
+    return dedup;
+}
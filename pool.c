@@ -0,0 +1,153 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+#define POOL_CHUNK_BLOCKS 64
+#define POOL_MAX_THREADS 64
+
+struct HashPool {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    pthread_t threads[POOL_MAX_THREADS];
+    int thread_count;
+    int started;
+    int busy;
+    unsigned long generation;
+
+    const unsigned char *buf;
+    size_t block_size;
+    uint32_t *hashes;
+    size_t blocks;
+    size_t next_chunk;
+    size_t pending_chunks;
+};
+
+struct HashPool hash_pool = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                             .work = PTHREAD_COND_INITIALIZER,
+                             .done = PTHREAD_COND_INITIALIZER};
+size_t hash_pool_threshold;
+
+// Hash chunks of the current job until there are none left to claim. Must be
+// called with the pool locked, and returns with it locked.
+void hash_pool_drain(void) {
+    while (hash_pool.next_chunk * POOL_CHUNK_BLOCKS < hash_pool.blocks) {
+        size_t first = hash_pool.next_chunk++ * POOL_CHUNK_BLOCKS;
+        size_t last = first + POOL_CHUNK_BLOCKS;
+        if (last > hash_pool.blocks)
+            last = hash_pool.blocks;
+
+        const unsigned char *buf = hash_pool.buf;
+        size_t block_size = hash_pool.block_size;
+        uint32_t *hashes = hash_pool.hashes;
+        pthread_mutex_unlock(&hash_pool.lock);
+
+        for (size_t i = first; i < last; i++)
+            hashes[i] = calculate_crc32c(0, &buf[i * block_size], block_size);
+
+        pthread_mutex_lock(&hash_pool.lock);
+        if (--hash_pool.pending_chunks == 0)
+            pthread_cond_signal(&hash_pool.done);
+    }
+}
+
+void *hash_pool_worker(void *arg) {
+    unsigned long generation = 0;
+
+    pthread_mutex_lock(&hash_pool.lock);
+    for (;;) {
+        while (hash_pool.generation == generation)
+            pthread_cond_wait(&hash_pool.work, &hash_pool.lock);
+        generation = hash_pool.generation;
+        hash_pool_drain();
+    }
+    return NULL;
+}
+
+void hash_pool_start(void) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    int started = 0;
+    for (int i = 0; i < hash_pool.thread_count; i++)
+        if (!pthread_create(&hash_pool.threads[i], &attr, hash_pool_worker,
+                            NULL))
+            started++;
+    pthread_attr_destroy(&attr);
+
+    if (started < hash_pool.thread_count)
+        fprintf(stderr,
+                "libwritededuper: only started %d of %d hashing threads\n",
+                started, hash_pool.thread_count);
+    hash_pool.started = 1;
+}
+
+// Threads don't survive fork, so the child starts its own pool on demand.
+void hash_pool_atfork_child(void) {
+    pthread_mutex_init(&hash_pool.lock, NULL);
+    pthread_cond_init(&hash_pool.work, NULL);
+    pthread_cond_init(&hash_pool.done, NULL);
+    hash_pool.started = 0;
+    hash_pool.busy = 0;
+}
+
+void hash_pool_init(void) {
+    char *str_threads;
+    if ((str_threads = getenv("LIBWRITEDEDUPER_HASH_THREADS")))
+        hash_pool.thread_count = atoi(str_threads);
+    if (hash_pool.thread_count > POOL_MAX_THREADS)
+        hash_pool.thread_count = POOL_MAX_THREADS;
+
+    char *str_threshold;
+    if ((str_threshold = getenv("LIBWRITEDEDUPER_HASH_THREADS_MIN")))
+        hash_pool_threshold = strtoul(str_threshold, NULL, 10);
+    else
+        hash_pool_threshold = 1024 * 1024;
+
+    if (hash_pool.thread_count > 0)
+        pthread_atfork(NULL, NULL, hash_pool_atfork_child);
+}
+
+// Fill `hashes` with the CRC of each block in `buf`. Large buffers are split
+// into chunks shared between the calling thread and the pool, each chunk
+// writing only its own slice of `hashes`.
+void hash_blocks(const unsigned char *buf, size_t block_size, uint32_t *hashes,
+                 size_t blocks) {
+    if (hash_pool.thread_count <= 0 ||
+        blocks * block_size < hash_pool_threshold ||
+        blocks <= POOL_CHUNK_BLOCKS) {
+    inline_hash:
+        for (size_t i = 0; i < blocks; i++)
+            hashes[i] = calculate_crc32c(0, &buf[i * block_size], block_size);
+        return;
+    }
+
+    pthread_mutex_lock(&hash_pool.lock);
+    if (hash_pool.busy) {
+        pthread_mutex_unlock(&hash_pool.lock);
+        goto inline_hash;
+    }
+    if (!hash_pool.started)
+        hash_pool_start();
+
+    hash_pool.busy = 1;
+    hash_pool.buf = buf;
+    hash_pool.block_size = block_size;
+    hash_pool.hashes = hashes;
+    hash_pool.blocks = blocks;
+    hash_pool.next_chunk = 0;
+    hash_pool.pending_chunks =
+        (blocks + POOL_CHUNK_BLOCKS - 1) / POOL_CHUNK_BLOCKS;
+    hash_pool.generation++;
+    pthread_cond_broadcast(&hash_pool.work);
+
+    hash_pool_drain();
+    while (hash_pool.pending_chunks)
+        pthread_cond_wait(&hash_pool.done, &hash_pool.lock);
+
+    hash_pool.busy = 0;
+    pthread_mutex_unlock(&hash_pool.lock);
+}
@@ -0,0 +1,475 @@
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "crc32.c"
+#include "hashmap/hashmap.c"
+
+static ssize_t (*libc_write)(int fd, const void *buf, size_t count) = write;
+
+#include "trace.c"
+
+#define REPLAY_BLOCK 0
+#define REPLAY_EXTENT 1
+// Simulated blocks per extent, as in the preload
+#define REPLAY_EXTENT_BLOCKS 16
+#define REPLAY_CANDIDATES_MAX 16
+
+// Rough size of a Redis sorted set key, and of each 64 byte path member in
+// it, with their dictionary entries, skiplist nodes and allocator overhead
+#define REPLAY_KEY_BYTES 96
+#define REPLAY_CANDIDATE_BYTES 128
+
+// Outcomes of a lookup
+#define REPLAY_MISS 0
+#define REPLAY_DUPLICATE 1
+#define REPLAY_UNCHANGED 2
+#define REPLAY_STALE 3
+#define REPLAY_COLLISION 4
+
+struct ReplayCandidate {
+    uint64_t ino;
+    int64_t offset;
+    // the whole fingerprint, to tell narrower keys that collide apart
+    uint32_t hash;
+};
+
+// A key of the index, namespaced by kind and device like the preload's, and
+// its candidates from the most recently recorded or used.
+struct ReplayEntry {
+    uint32_t kind;
+    uint32_t key;
+    uint64_t dev;
+    uint64_t used;
+    size_t count;
+    struct ReplayCandidate candidates[REPLAY_CANDIDATES_MAX];
+};
+
+struct ReplayLocation {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t offset;
+    uint32_t hash;
+};
+
+// An entry as it was when last used. Entries are evicted from the front,
+// skipping uses that were superseded by later ones.
+struct ReplayUse {
+    uint32_t kind;
+    uint32_t key;
+    uint64_t dev;
+    uint64_t used;
+};
+
+struct ReplayStats {
+    uint64_t records;
+    uint64_t written;
+    uint64_t read;
+    uint64_t unaligned;
+    uint64_t lookups;
+    uint64_t duplicate;
+    uint64_t unchanged;
+    uint64_t stale;
+    uint64_t collisions;
+    uint64_t evictions;
+    size_t candidates;
+    size_t peak;
+    size_t peak_bytes;
+};
+
+struct hashmap *index_entries;
+struct hashmap *locations;
+struct ReplayUse *uses;
+size_t uses_head, uses_tail, uses_size;
+uint64_t clock_tick;
+
+size_t replay_multiple = 1;
+size_t replay_capacity = 0;
+size_t replay_candidates = 4;
+uint32_t replay_mask = UINT32_MAX;
+struct ReplayStats stats;
+
+uint64_t replay_entry_hash(const void *item, uint64_t seed0, uint64_t seed1) {
+    const struct ReplayEntry *entry = item;
+    return hashmap_sip(entry, offsetof(struct ReplayEntry, used), seed0,
+                       seed1);
+}
+
+int replay_entry_compare(const void *a, const void *b, void *data) {
+    const struct ReplayEntry *aa = a;
+    const struct ReplayEntry *bb = b;
+    return aa->kind != bb->kind || aa->key != bb->key || aa->dev != bb->dev;
+}
+
+uint64_t replay_location_hash(const void *item, uint64_t seed0,
+                              uint64_t seed1) {
+    const struct ReplayLocation *location = item;
+    return hashmap_sip(location, offsetof(struct ReplayLocation, hash), seed0,
+                       seed1);
+}
+
+int replay_location_compare(const void *a, const void *b, void *data) {
+    const struct ReplayLocation *aa = a;
+    const struct ReplayLocation *bb = b;
+    return aa->dev != bb->dev || aa->ino != bb->ino ||
+           aa->offset != bb->offset;
+}
+
+uint32_t replay_extent_hash(const uint32_t *hashes) {
+    return calculate_crc32c(0, (const unsigned char *)hashes,
+                            REPLAY_EXTENT_BLOCKS * sizeof(uint32_t));
+}
+
+void replay_use(struct ReplayEntry *entry) {
+    entry->used = ++clock_tick;
+    const struct ReplayEntry *old = hashmap_set(index_entries, entry);
+    stats.candidates += entry->count - (old ? old->count : 0);
+    if (!replay_capacity)
+        return;
+
+    if (uses_tail == uses_size) {
+        if (uses_head > uses_size / 2) {
+            memmove(uses, &uses[uses_head],
+                    (uses_tail - uses_head) * sizeof(struct ReplayUse));
+            uses_tail -= uses_head;
+            uses_head = 0;
+        } else {
+            uses_size = uses_size ? uses_size * 2 : 4096;
+            if (!(uses = realloc(uses, uses_size * sizeof(struct ReplayUse)))) {
+                perror("replay: couldn't grow the use queue");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    uses[uses_tail++] =
+        (struct ReplayUse){entry->kind, entry->key, entry->dev, entry->used};
+
+    // evict the least recently used entries over capacity
+    while (hashmap_count(index_entries) > replay_capacity) {
+        struct ReplayUse use = uses[uses_head++];
+        struct ReplayEntry key = {
+            .kind = use.kind, .key = use.key, .dev = use.dev};
+        const struct ReplayEntry *old = hashmap_get(index_entries, &key);
+        if (old && old->used == use.used) {
+            stats.candidates -= old->count;
+            hashmap_delete(index_entries, &key);
+            stats.evictions++;
+        }
+    }
+}
+
+// Whether the `blocks` simulated blocks at `offset` in `ino` still hold
+// `hashes`, the way the preload verifies a candidate against the data being
+// written.
+int replay_holds(uint64_t dev, uint64_t ino, int64_t offset,
+                 const uint32_t *hashes, size_t blocks, size_t block_size) {
+    for (size_t i = 0; i < blocks; i++) {
+        const struct ReplayLocation *location = hashmap_get(
+            locations,
+            &(struct ReplayLocation){dev, ino, offset + i * block_size});
+        if (!location || location->hash != hashes[i])
+            return 0;
+    }
+    return 1;
+}
+
+// Look up `blocks` simulated blocks written at `offset`, trying candidates
+// from the most recent one like the preload does. The one used moves to the
+// front.
+int replay_lookup(uint32_t kind, uint64_t dev, uint64_t ino, int64_t offset,
+                  uint32_t hash, const uint32_t *hashes, size_t blocks,
+                  size_t block_size) {
+    struct ReplayEntry key = {
+        .kind = kind, .key = hash & replay_mask, .dev = dev};
+    const struct ReplayEntry *found = hashmap_get(index_entries, &key);
+    if (!found)
+        return REPLAY_MISS;
+
+    struct ReplayEntry entry = *found;
+    int result = REPLAY_MISS;
+    for (size_t i = 0; i < entry.count; i++) {
+        struct ReplayCandidate candidate = entry.candidates[i];
+        if (candidate.hash != hash) {
+            result = REPLAY_COLLISION;
+            continue;
+        }
+        if (!replay_holds(dev, candidate.ino, candidate.offset, hashes, blocks,
+                          block_size)) {
+            if (result == REPLAY_MISS)
+                result = REPLAY_STALE;
+            continue;
+        }
+
+        memmove(&entry.candidates[1], &entry.candidates[0],
+                i * sizeof(struct ReplayCandidate));
+        entry.candidates[0] = candidate;
+        replay_use(&entry);
+        return candidate.ino == ino && candidate.offset == offset
+                   ? REPLAY_UNCHANGED
+                   : REPLAY_DUPLICATE;
+    }
+    return result;
+}
+
+// Make the location the most recent candidate of its key, the way the preload
+// claims keys nobody had and records blocks it didn't clone. Candidates past
+// the limit, stale ones included, fall off the end.
+void replay_add(uint32_t kind, uint64_t dev, uint64_t ino, int64_t offset,
+                uint32_t hash) {
+    struct ReplayEntry entry = {
+        .kind = kind, .key = hash & replay_mask, .dev = dev};
+    const struct ReplayEntry *found = hashmap_get(index_entries, &entry);
+    if (found)
+        entry = *found;
+
+    size_t i = 0;
+    while (i < entry.count && (entry.candidates[i].ino != ino ||
+                               entry.candidates[i].offset != offset))
+        i++;
+    if (i == entry.count && entry.count < replay_candidates)
+        entry.count++;
+    if (i == entry.count)
+        i--;
+    memmove(&entry.candidates[1], &entry.candidates[0],
+            i * sizeof(struct ReplayCandidate));
+    entry.candidates[0] = (struct ReplayCandidate){ino, offset, hash};
+    replay_use(&entry);
+}
+
+void replay_count(int result, size_t blocks) {
+    if (result == REPLAY_DUPLICATE)
+        stats.duplicate += blocks;
+    else if (result == REPLAY_UNCHANGED)
+        stats.unchanged += blocks;
+    else if (result == REPLAY_STALE)
+        stats.stale++;
+    else if (result == REPLAY_COLLISION)
+        stats.collisions++;
+}
+
+// Replay the simulated blocks of one record. A write looks up its aligned
+// extents, then the blocks they didn't cover, and records whatever it didn't
+// clone, while a read records everything.
+void replay_blocks(int type, uint64_t dev, uint64_t ino, int64_t offset,
+                   const uint32_t *hashes, size_t count, size_t block_size) {
+    // 1 for a block cloned on its own, 2 for one cloned with its extent and 3
+    // for one whose extent was found where it is written
+    unsigned char *found = calloc(count + 1, 1);
+    if (!found) {
+        perror("replay: couldn't allocate a record");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t first = offset / block_size;
+    if (type == TRACE_WRITE) {
+        stats.lookups += count;
+        for (size_t i = 0; i + REPLAY_EXTENT_BLOCKS <= count; i++) {
+            if ((first + i) % REPLAY_EXTENT_BLOCKS)
+                continue;
+            int result = replay_lookup(REPLAY_EXTENT, dev, ino,
+                                       offset + i * block_size,
+                                       replay_extent_hash(&hashes[i]),
+                                       &hashes[i], REPLAY_EXTENT_BLOCKS,
+                                       block_size);
+            replay_count(result, REPLAY_EXTENT_BLOCKS);
+            if (result == REPLAY_DUPLICATE || result == REPLAY_UNCHANGED)
+                memset(&found[i], result == REPLAY_DUPLICATE ? 2 : 3,
+                       REPLAY_EXTENT_BLOCKS);
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            if (found[i])
+                continue;
+            int result = replay_lookup(REPLAY_BLOCK, dev, ino,
+                                       offset + i * block_size, hashes[i],
+                                       &hashes[i], 1, block_size);
+            replay_count(result, 1);
+            if (result == REPLAY_DUPLICATE)
+                found[i] = 1;
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (found[i] != 1 && found[i] != 2)
+            replay_add(REPLAY_BLOCK, dev, ino, offset + i * block_size,
+                       hashes[i]);
+        if ((first + i) % REPLAY_EXTENT_BLOCKS == 0 &&
+            i + REPLAY_EXTENT_BLOCKS <= count && found[i] != 2)
+            replay_add(REPLAY_EXTENT, dev, ino, offset + i * block_size,
+                       replay_extent_hash(&hashes[i]));
+    }
+    for (size_t i = 0; i < count; i++)
+        hashmap_set(locations,
+                    &(struct ReplayLocation){dev, ino, offset + i * block_size,
+                                             hashes[i]});
+    free(found);
+
+    size_t bytes = hashmap_count(index_entries) * REPLAY_KEY_BYTES +
+                   stats.candidates * REPLAY_CANDIDATE_BYTES;
+    if (hashmap_count(index_entries) > stats.peak)
+        stats.peak = hashmap_count(index_entries);
+    if (bytes > stats.peak_bytes)
+        stats.peak_bytes = bytes;
+}
+
+void replay_record(const struct TraceRecord *record, const uint32_t *hashes,
+                   uint32_t block_size) {
+    stats.records++;
+    if (record->type == TRACE_WRITE)
+        stats.written += record->blocks;
+    else
+        stats.read += record->blocks;
+
+    // only simulated blocks wholly inside the record can be deduplicated
+    size_t first = record->offset / block_size;
+    size_t i = (replay_multiple - first % replay_multiple) % replay_multiple;
+    size_t count =
+        i < record->blocks ? (record->blocks - i) / replay_multiple : 0;
+    stats.unaligned += record->blocks - count * replay_multiple;
+
+    uint32_t *simulated = malloc((count + 1) * sizeof(uint32_t));
+    if (!simulated) {
+        perror("replay: couldn't allocate fingerprints");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t j = 0; j < count; j++) {
+        const uint32_t *traced = &hashes[i + j * replay_multiple];
+        simulated[j] = replay_multiple > 1
+                           ? calculate_crc32c(0, (const unsigned char *)traced,
+                                              replay_multiple *
+                                                  sizeof(uint32_t))
+                           : *traced;
+    }
+    replay_blocks(record->type, record->dev, record->ino,
+                  record->offset + i * block_size, simulated, count,
+                  block_size * replay_multiple);
+    free(simulated);
+}
+
+int replay_file(const char *path, uint32_t *block_size) {
+    FILE *file;
+    if (!(file = fopen(path, "r"))) {
+        fprintf(stderr, "replay: couldn't open %s: %m\n", path);
+        return 0;
+    }
+
+    struct TraceHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != TRACE_VERSION ||
+        (*block_size && header.block_size != *block_size)) {
+        fprintf(stderr, "replay: %s isn't a compatible trace\n", path);
+        fclose(file);
+        return 0;
+    }
+    *block_size = header.block_size;
+
+    struct TraceRecord record;
+    uint32_t *hashes = NULL;
+    size_t capacity = 0;
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        if (record.blocks > capacity) {
+            capacity = record.blocks;
+            if (!(hashes = realloc(hashes, capacity * sizeof(uint32_t)))) {
+                perror("replay: couldn't allocate fingerprints");
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (fread(hashes, sizeof(uint32_t), record.blocks, file) !=
+            record.blocks) {
+            fprintf(stderr, "replay: %s is truncated\n", path);
+            break;
+        }
+        replay_record(&record, hashes, header.block_size);
+    }
+
+    free(hashes);
+    fclose(file);
+    return 1;
+}
+
+void usage(char *name) {
+    fprintf(stderr,
+            "usage: %s [-b multiple] [-c entries] [-n candidates] [-w bits] "
+            "trace...\n"
+            "  -b  simulated block size, as a multiple of the traced one (1)\n"
+            "  -c  index capacity, evicting the least recently used entries "
+            "(unlimited)\n"
+            "  -n  locations kept per fingerprint, at most 16 (4)\n"
+            "  -w  fingerprint width in bits, at most 32 (32)\n",
+            name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "b:c:n:w:")) != -1) {
+        switch (opt) {
+        case 'b':
+            if (!(replay_multiple = strtoul(optarg, NULL, 10)))
+                usage(argv[0]);
+            break;
+        case 'c':
+            replay_capacity = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            replay_candidates = strtoul(optarg, NULL, 10);
+            if (!replay_candidates ||
+                replay_candidates > REPLAY_CANDIDATES_MAX)
+                usage(argv[0]);
+            break;
+        case 'w': {
+            unsigned long width = strtoul(optarg, NULL, 10);
+            if (!width || width > 32)
+                usage(argv[0]);
+            replay_mask = width == 32 ? UINT32_MAX : (1U << width) - 1;
+            break;
+        }
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind >= argc)
+        usage(argv[0]);
+
+    index_entries = hashmap_new(sizeof(struct ReplayEntry), 0, 0, 0,
+                                replay_entry_hash, replay_entry_compare, NULL,
+                                NULL);
+    locations = hashmap_new(sizeof(struct ReplayLocation), 0, 0, 0,
+                            replay_location_hash, replay_location_compare,
+                            NULL, NULL);
+
+    uint32_t block_size = 0;
+    for (int i = optind; i < argc; i++)
+        if (!replay_file(argv[i], &block_size))
+            return EXIT_FAILURE;
+
+    size_t simulated = block_size * replay_multiple;
+    printf("block size:      %zu bytes\n", simulated);
+    printf("records:         %lu\n", stats.records);
+    printf("written:         %lu bytes\n", stats.written * block_size);
+    printf("read:            %lu bytes\n", stats.read * block_size);
+    printf("unaligned:       %lu bytes\n", stats.unaligned * block_size);
+    printf("deduplicated:    %lu bytes (%.2f%% of written)\n",
+           stats.duplicate * simulated,
+           stats.written ? 100.0 * stats.duplicate * simulated /
+                               (stats.written * block_size)
+                         : 0);
+    printf("unchanged:       %lu bytes\n", stats.unchanged * simulated);
+    printf("hit rate:        %.2f%%\n",
+           stats.lookups ? 100.0 * stats.duplicate / stats.lookups : 0);
+    printf("stale hits:      %lu\n", stats.stale);
+    printf("collisions:      %lu\n", stats.collisions);
+    printf("evictions:       %lu\n", stats.evictions);
+    printf("index entries:   %zu with %zu candidates (peak %zu, about %zu "
+           "MiB)\n",
+           hashmap_count(index_entries), stats.candidates, stats.peak,
+           stats.peak_bytes >> 20);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,262 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <linux/limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RING_DEFAULT_NAME "/libwritededuper"
+#define RING_MAGIC 0x6c776464
+#define RING_SLOTS 32
+#define RING_BLOCKS 256
+#define RING_UNAVAILABLE -2
+
+enum {
+    RING_SLOT_FREE,
+    RING_SLOT_CLAIMED,
+    RING_SLOT_SUBMITTED,
+    RING_SLOT_PROCESSING,
+    RING_SLOT_DONE,
+};
+
+enum {
+    RING_WRITE,
+    RING_READ,
+};
+
+// One request from a preloaded process. The daemon opens the target through
+// /proc/<pid>/fd/<fd>, clones whatever it can verify for RING_WRITE and
+// reports it in `cloned`, and records the blocks of RING_READ. Either way it
+// also records the blocks it left to the client, which writes them out.
+struct RingSlot {
+    uint32_t state;
+    uint32_t type;
+    pid_t pid;
+    int fd;
+    off_t offset;
+    uint32_t blocks;
+    // the predicted source of the first block on the way in, and the next
+    // block after the source of the last one on the way out
+    char in_path[PATH_MAX];
+    off_t in_offset;
+    uint8_t cloned[RING_BLOCKS];
+    uint32_t hashes[RING_BLOCKS];
+    unsigned char data[RING_BLOCKS * BLOCK_SIZE];
+};
+
+// Slots are claimed round robin by the preloaded processes and served in
+// ring order by the daemon, which sleeps on `doorbell` between requests.
+struct Ring {
+    uint32_t magic;
+    pid_t pid;
+    uint32_t doorbell;
+    uint32_t next_slot;
+    struct RingSlot slots[RING_SLOTS];
+};
+
+struct Ring *shared_ring = NULL;
+long ring_timeout_ms;
+
+long ring_futex(uint32_t *word, int op, uint32_t value,
+                const struct timespec *timeout) {
+    return syscall(SYS_futex, word, op, value, timeout, NULL, 0);
+}
+
+char *ring_name(void) {
+    char *name;
+    if (!(name = getenv("LIBWRITEDEDUPER_DAEMON")) || !*name ||
+        strcmp(name, "1") == 0)
+        name = RING_DEFAULT_NAME;
+    return name;
+}
+
+// Map the daemon's ring if LIBWRITEDEDUPER_DAEMON is set and it is running.
+int ring_attach(void) {
+    if (!getenv("LIBWRITEDEDUPER_DAEMON"))
+        return 0;
+
+    char *str_timeout;
+    if ((str_timeout = getenv("LIBWRITEDEDUPER_DAEMON_TIMEOUT_MS")))
+        ring_timeout_ms = atol(str_timeout);
+    else
+        ring_timeout_ms = 1000;
+
+    int fd;
+    if ((fd = shm_open(ring_name(), O_RDWR, 0)) < 0)
+        return 0;
+
+    struct stat st;
+    struct Ring *ring = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size == sizeof(struct Ring))
+        ring = mmap(NULL, sizeof(struct Ring), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == MAP_FAILED)
+        return 0;
+
+    if (__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != RING_MAGIC ||
+        kill(ring->pid, 0) != 0) {
+        munmap(ring, sizeof(struct Ring));
+        return 0;
+    }
+
+    __atomic_store_n(&shared_ring, ring, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// Stop using `ring` once its daemon is gone. It stays mapped, as other
+// threads may still be filling or waiting on slots they claimed from it.
+void ring_detach(struct Ring *ring) {
+    struct Ring *expected = ring;
+    if (__atomic_compare_exchange_n(&shared_ring, &expected, NULL, 0,
+                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        fprintf(stderr, "libwritededuper: daemon stopped responding, "
+                        "deduplicating in-process\n");
+}
+
+// The ring the calling thread works with, loaded once so that it stays the
+// same while its slots are in use even if another thread detaches.
+struct Ring *ring_current(void) {
+    return __atomic_load_n(&shared_ring, __ATOMIC_ACQUIRE);
+}
+
+struct RingSlot *ring_claim(struct Ring *ring) {
+    for (int i = 0; i < RING_SLOTS; i++) {
+        uint32_t index =
+            __atomic_fetch_add(&ring->next_slot, 1, __ATOMIC_RELAXED);
+        struct RingSlot *slot = &ring->slots[index % RING_SLOTS];
+        uint32_t expected = RING_SLOT_FREE;
+        if (__atomic_compare_exchange_n(&slot->state, &expected,
+                                        RING_SLOT_CLAIMED, 0, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED))
+            return slot;
+    }
+    return NULL;
+}
+
+void ring_post(struct Ring *ring, struct RingSlot *slot) {
+    __atomic_store_n(&slot->state, RING_SLOT_SUBMITTED, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&ring->doorbell, 1, __ATOMIC_RELEASE);
+    ring_futex(&ring->doorbell, FUTEX_WAKE, 1, NULL);
+}
+
+// Hand `slot` to the daemon and wait for it to be served. Gives the slot back
+// and returns 0 if the daemon didn't get to it in time, or detaches from the
+// ring if the daemon is gone.
+int ring_submit(struct Ring *ring, struct RingSlot *slot) {
+    ring_post(ring, slot);
+
+    struct timespec timeout = {ring_timeout_ms / 1000,
+                               (ring_timeout_ms % 1000) * 1000000};
+    uint32_t state;
+    while ((state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE)) !=
+           RING_SLOT_DONE) {
+        if (ring_futex(&slot->state, FUTEX_WAIT, state, &timeout) == 0 ||
+            errno != ETIMEDOUT)
+            continue;
+
+        uint32_t expected = RING_SLOT_SUBMITTED;
+        if (__atomic_compare_exchange_n(&slot->state, &expected,
+                                        RING_SLOT_FREE, 0, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED))
+            return 0;
+        if (kill(ring->pid, 0) != 0) {
+            ring_detach(ring);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void ring_release(struct RingSlot *slot) {
+    __atomic_store_n(&slot->state, RING_SLOT_FREE, __ATOMIC_RELEASE);
+}
+
+// Deduplicate `dedup` through the daemon, RING_BLOCKS at a time, writing out
+// whatever it couldn't clone. Returns RING_UNAVAILABLE if nothing was done.
+ssize_t ring_dedup(struct Dedup *dedup) {
+    ssize_t total_written = 0;
+    for (size_t first = 0; first < dedup->blocks; first += RING_BLOCKS) {
+        struct Ring *ring = ring_current();
+        struct RingSlot *slot;
+        if (!ring || !(slot = ring_claim(ring)))
+            return total_written ? total_written : RING_UNAVAILABLE;
+
+        struct Dedup chunk = {
+            .fd = dedup->fd,
+            .dev = dedup->dev,
+            .path = dedup->path,
+            .offset = dedup->offset + first * BLOCK_SIZE,
+            .buf = &dedup->buf[first * BLOCK_SIZE],
+            .blocks = dedup->blocks - first,
+            .hashes = &dedup->hashes[first],
+            .sources = &dedup->sources[first],
+        };
+        if (chunk.blocks > RING_BLOCKS)
+            chunk.blocks = RING_BLOCKS;
+
+        slot->type = RING_WRITE;
+        slot->pid = getpid();
+        slot->fd = chunk.fd;
+        slot->offset = chunk.offset;
+        slot->blocks = chunk.blocks;
+        memcpy(slot->hashes, chunk.hashes, chunk.blocks * sizeof(uint32_t));
+        memcpy(slot->data, chunk.buf, chunk.blocks * BLOCK_SIZE);
+
+        if (!stream_prediction(dedup->fd, chunk.offset, slot->in_path,
+                               &slot->in_offset))
+            slot->in_path[0] = 0;
+
+        if (!ring_submit(ring, slot))
+            return total_written ? total_written : RING_UNAVAILABLE;
+
+        for (size_t i = 0; i < chunk.blocks; i++)
+            chunk.sources[i].path = slot->cloned[i] ? chunk.path : NULL;
+        if (slot->in_path[0])
+            stream_predict(chunk.fd, slot->in_path, slot->in_offset,
+                           chunk.offset + chunk.blocks * BLOCK_SIZE);
+        ring_release(slot);
+
+        ssize_t written;
+        if ((written = dedup_write(&chunk)) < 0)
+            return total_written ? total_written : written;
+        total_written += written;
+        if (written < chunk.blocks * BLOCK_SIZE)
+            break;
+    }
+    return total_written;
+}
+
+// Have the daemon record the blocks that were read into `dedup`. Nothing is
+// waited for, the daemon frees these slots itself. Returns how many blocks
+// were handed over, from the first, which stops short when the ring is full.
+size_t ring_record(struct Dedup *dedup) {
+    size_t first;
+    for (first = 0; first < dedup->blocks; first += RING_BLOCKS) {
+        struct Ring *ring = ring_current();
+        struct RingSlot *slot;
+        if (!ring || !(slot = ring_claim(ring)))
+            return first;
+
+        slot->type = RING_READ;
+        slot->pid = getpid();
+        slot->fd = dedup->fd;
+        slot->offset = dedup->offset + first * BLOCK_SIZE;
+        slot->blocks = dedup->blocks - first;
+        if (slot->blocks > RING_BLOCKS)
+            slot->blocks = RING_BLOCKS;
+        memcpy(slot->hashes, &dedup->hashes[first],
+               slot->blocks * sizeof(uint32_t));
+        ring_post(ring, slot);
+    }
+    return dedup->blocks;
+}
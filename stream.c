@@ -0,0 +1,145 @@
+#include <linux/limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "hashmap/hashmap.h"
+
+struct Stream {
+    int fd;
+    char *in_path;
+    off_t in_offset;
+    off_t offset;
+    // the file the policy was evaluated for, as the fd may be reused
+    dev_t dev;
+    ino_t ino;
+    int policy;
+    // blocks written since the last one that was cloned, and writes passed
+    // through since, see bypass.c
+    size_t misses;
+    size_t bypassed;
+};
+
+struct hashmap *streams;
+pthread_mutex_t stream_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t stream_hash(const void *item, uint64_t seed0, uint64_t seed1) {
+    const struct Stream *stream = item;
+    return hashmap_sip(&stream->fd, sizeof(stream->fd), seed0, seed1);
+}
+
+int stream_compare(const void *a, const void *b, void *data) {
+    const struct Stream *aa = a;
+    const struct Stream *bb = b;
+    return aa->fd - bb->fd;
+}
+
+void stream_free(void *item) {
+    struct Stream *stream = item;
+    free(stream->in_path);
+}
+
+// Copy the stream of `fd` to `*stream`, without its `in_path`, which another
+// thread may free. Returns 0 if there is none.
+int get_stream(int fd, struct Stream *stream) {
+    pthread_mutex_lock(&stream_lock);
+    const struct Stream *found =
+        hashmap_get(streams, &(struct Stream){.fd = fd});
+    if (found) {
+        *stream = *found;
+        stream->in_path = NULL;
+    }
+    pthread_mutex_unlock(&stream_lock);
+    return found != NULL;
+}
+
+// Copy where the block written to `offset` on `fd` is expected to be found to
+// `in_path`, of PATH_MAX bytes, and `*in_offset`. Returns 0 if it wasn't
+// predicted.
+int stream_prediction(int fd, off_t offset, char *in_path, off_t *in_offset) {
+    pthread_mutex_lock(&stream_lock);
+    const struct Stream *stream =
+        hashmap_get(streams, &(struct Stream){.fd = fd});
+    int found = stream && stream->in_path && stream->offset == offset;
+    if (found) {
+        strlcpy(in_path, stream->in_path, PATH_MAX - 1);
+        *in_offset = stream->in_offset;
+    }
+    pthread_mutex_unlock(&stream_lock);
+    return found;
+}
+
+// Remember that the block written to `offset` on `fd` is expected to be
+// found at `in_offset` in `in_path`, i.e. right after the last match.
+void stream_predict(int fd, char *in_path, off_t in_offset, off_t offset) {
+    pthread_mutex_lock(&stream_lock);
+    const struct Stream *stream =
+        hashmap_get(streams, &(struct Stream){.fd = fd});
+
+    char *stream_in_path;
+    if (stream && stream->in_path && strcmp(stream->in_path, in_path) == 0)
+        stream_in_path = stream->in_path;
+    else {
+        if (!(stream_in_path = strdup(in_path))) {
+            pthread_mutex_unlock(&stream_lock);
+            return;
+        }
+        if (stream)
+            free(stream->in_path);
+    }
+
+    struct Stream new_stream = stream ? *stream : (struct Stream){.fd = fd};
+    new_stream.in_path = stream_in_path;
+    new_stream.in_offset = in_offset;
+    new_stream.offset = offset;
+    hashmap_set(streams, &new_stream);
+    pthread_mutex_unlock(&stream_lock);
+}
+
+// Remember whether `fd`, open on the file `dev` and `ino`, is deduplicated.
+// A stream left over from another file opened on the same fd is dropped.
+void stream_set_policy(int fd, dev_t dev, ino_t ino, int policy) {
+    pthread_mutex_lock(&stream_lock);
+    const struct Stream *stream =
+        hashmap_get(streams, &(struct Stream){.fd = fd});
+
+    struct Stream new_stream = {.fd = fd, .dev = dev, .ino = ino};
+    if (stream && stream->dev == dev && stream->ino == ino)
+        new_stream = *stream;
+    else if (stream)
+        free(stream->in_path);
+    new_stream.policy = policy;
+    hashmap_set(streams, &new_stream);
+    pthread_mutex_unlock(&stream_lock);
+}
+
+// Count a write to `fd` as passed through, returning how many were before it.
+size_t stream_count_bypassed(int fd) {
+    pthread_mutex_lock(&stream_lock);
+    const struct Stream *stream =
+        hashmap_get(streams, &(struct Stream){.fd = fd});
+
+    struct Stream new_stream = stream ? *stream : (struct Stream){.fd = fd};
+    size_t bypassed = new_stream.bypassed++;
+    hashmap_set(streams, &new_stream);
+    pthread_mutex_unlock(&stream_lock);
+    return bypassed;
+}
+
+// Count `blocks` more blocks in a row that `fd` missed, or start over along
+// with the writes passed through if any of them was a hit.
+void stream_count_misses(int fd, size_t blocks, size_t hits) {
+    pthread_mutex_lock(&stream_lock);
+    const struct Stream *stream =
+        hashmap_get(streams, &(struct Stream){.fd = fd});
+
+    struct Stream new_stream = stream ? *stream : (struct Stream){.fd = fd};
+    if (hits)
+        new_stream.misses = new_stream.bypassed = 0;
+    else
+        new_stream.misses += blocks;
+    hashmap_set(streams, &new_stream);
+    pthread_mutex_unlock(&stream_lock);
+}
@@ -0,0 +1,104 @@
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define TRACE_MAGIC "LWDTRACE"
+#define TRACE_VERSION 1
+
+// Blocks of a write are looked up before being indexed, blocks of a read
+// (and of a copy) are only indexed.
+#define TRACE_WRITE 0
+#define TRACE_READ 1
+
+struct TraceHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_size;
+};
+
+// Followed by `blocks` fingerprints of `block_size` bytes each, starting at
+// `offset` in the file identified by `dev` and `ino`.
+struct TraceRecord {
+    uint32_t type;
+    uint32_t blocks;
+    uint64_t dev;
+    uint64_t ino;
+    int64_t offset;
+};
+
+int trace_fd = -1;
+
+// Open the trace named by LIBWRITEDEDUPER_TRACE, shared by every process
+// appending to it. A new trace is written with its header under a temporary
+// name and linked into place, so nothing can be appended before the header.
+// Returns whether tracing is on, in which case the index is never used.
+int trace_init(uint32_t block_size) {
+    char *path;
+    if (!(path = getenv("LIBWRITEDEDUPER_TRACE")) || !*path)
+        return 0;
+
+    char temporary[PATH_MAX];
+    if (snprintf(temporary, sizeof(temporary), "%s.%d", path, getpid()) >=
+        (int)sizeof(temporary)) {
+        fprintf(stderr, "libwritededuper: trace path %s is too long\n", path);
+        return 0;
+    }
+
+    int fd;
+    if ((fd = open(temporary,
+                   O_WRONLY | O_APPEND | O_CREAT | O_EXCL | O_CLOEXEC,
+                   0644)) >= 0) {
+        struct TraceHeader header = {.magic = TRACE_MAGIC,
+                                     .version = TRACE_VERSION,
+                                     .block_size = block_size};
+        int linked =
+            (*libc_write)(fd, &header, sizeof(header)) == sizeof(header) &&
+            link(temporary, path) == 0;
+        unlink(temporary);
+        if (!linked) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd < 0 && (fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC)) < 0) {
+        fprintf(stderr, "libwritededuper: couldn't open trace %s: %m\n", path);
+        return 0;
+    }
+
+    trace_fd = fd;
+    return 1;
+}
+
+// Append the fingerprints of `blocks` blocks at `offset` in `fd` to the
+// trace, in a single write so that records of concurrent processes don't
+// interleave.
+void trace_record(int type, int fd, off_t offset, const uint32_t *hashes,
+                  size_t blocks) {
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        return;
+
+    size_t size = sizeof(struct TraceRecord) + blocks * sizeof(uint32_t);
+    unsigned char *record;
+    if (!(record = malloc(size)))
+        return;
+
+    *(struct TraceRecord *)record = (struct TraceRecord){
+        .type = type,
+        .blocks = blocks,
+        .dev = st.st_dev,
+        .ino = st.st_ino,
+        .offset = offset,
+    };
+    memcpy(&record[sizeof(struct TraceRecord)], hashes,
+           blocks * sizeof(uint32_t));
+    if ((*libc_write)(trace_fd, record, size) != (ssize_t)size)
+        fprintf(stderr, "libwritededuper: couldn't append to trace: %m\n");
+    free(record);
+}
@@ -0,0 +1,134 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+struct IoOp {
+    int fd;
+    void *buf;
+    size_t length;
+    off_t offset;
+    ssize_t result;
+};
+
+#ifdef LIBWRITEDEDUPER_URING
+#include <liburing.h>
+// pulled in through linux/fs.h, and unrelated to ours
+#undef BLOCK_SIZE
+
+#define URING_DEFAULT_DEPTH 64
+
+struct io_uring ring;
+unsigned int ring_depth;
+int ring_ready = 0;
+pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// A forked child must not share its parent's rings.
+void uring_atfork_child(void) {
+    pthread_mutex_init(&ring_lock, NULL);
+    if (ring_ready) {
+        io_uring_queue_exit(&ring);
+        ring_ready = io_uring_queue_init(ring_depth, &ring, 0) == 0;
+    }
+}
+
+void uring_init(void) {
+    char *str_depth;
+    if ((str_depth = getenv("LIBWRITEDEDUPER_URING_DEPTH")))
+        ring_depth = atoi(str_depth);
+    else
+        ring_depth = URING_DEFAULT_DEPTH;
+
+    // io_uring may be disabled or filtered, in which case every batch just
+    // goes through the regular syscalls
+    if (ring_depth > 0 && io_uring_queue_init(ring_depth, &ring, 0) == 0)
+        ring_ready = 1;
+    pthread_atfork(NULL, NULL, uring_atfork_child);
+}
+
+// Stop using the ring after it failed in a way that leaves it in an unknown
+// state, so that later batches go through the regular syscalls.
+void uring_disable(void) {
+    io_uring_queue_exit(&ring);
+    ring_ready = 0;
+    fprintf(stderr, "libwritededuper: io_uring failed, not using it anymore\n");
+}
+
+// Submit `ops` as reads or writes, `ring_depth` at a time, and wait for all
+// of them. Results are byte counts or negated errno values, like the ring's
+// completions. Returns 0 without doing anything if the ring is unavailable or
+// already in use by another thread, and also if it fails midway, as every op
+// can simply be done again.
+int uring_batch(struct IoOp *ops, size_t count, int write) {
+    if (!ring_ready || pthread_mutex_trylock(&ring_lock) != 0)
+        return 0;
+
+    for (size_t first = 0; first < count; first += ring_depth) {
+        size_t last = first + ring_depth;
+        if (last > count)
+            last = count;
+
+        for (size_t i = first; i < last; i++) {
+            struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+            if (!sqe) {
+                uring_disable();
+                pthread_mutex_unlock(&ring_lock);
+                return 0;
+            }
+            if (write)
+                io_uring_prep_write(sqe, ops[i].fd, ops[i].buf,
+                                    ops[i].length, ops[i].offset);
+            else
+                io_uring_prep_read(sqe, ops[i].fd, ops[i].buf, ops[i].length,
+                                   ops[i].offset);
+            io_uring_sqe_set_data64(sqe, i);
+            ops[i].result = -EIO;
+        }
+
+        // every submitted op is reaped before its buffer can go away, and
+        // before the next batch could mistake its completion for its own
+        size_t submitted = 0, completed = 0;
+        int failed = 0;
+        while (completed < submitted || (!failed && submitted < last - first)) {
+            if (!failed && submitted < last - first) {
+                int result = io_uring_submit(&ring);
+                if (result > 0)
+                    submitted += result;
+                else if (result < 0 && result != -EINTR &&
+                         result != -EAGAIN && result != -EBUSY)
+                    failed = 1;
+            }
+            if (completed == submitted)
+                continue;
+
+            struct io_uring_cqe *cqe;
+            int result = io_uring_wait_cqe(&ring, &cqe);
+            if (result == -EINTR || result == -EAGAIN)
+                continue;
+            if (result < 0) {
+                failed = 1;
+                break;
+            }
+            uint64_t i = io_uring_cqe_get_data64(cqe);
+            if (i >= first && i < last)
+                ops[i].result = cqe->res;
+            io_uring_cqe_seen(&ring, cqe);
+            completed++;
+        }
+        if (failed) {
+            uring_disable();
+            pthread_mutex_unlock(&ring_lock);
+            return 0;
+        }
+    }
+
+    pthread_mutex_unlock(&ring_lock);
+    return 1;
+}
+#else
+void uring_init(void) {}
+
+int uring_batch(struct IoOp *ops, size_t count, int write) { return 0; }
+#endif